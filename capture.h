@@ -0,0 +1,58 @@
+/*
+ * Capture files, written by the server with -r and read back by the replay tool.
+ *
+ * CAPTURE_MAGIC, then one record per event, CAPTURE_RECORD_LEN bytes followed by len bytes:
+ *
+ *	u8 kind | u32 connection | u32 microseconds since the previous record | u32 len
+ *
+ * All integers are big endian. Frames are kept as they arrived, except file chunks:
+ * only their header is kept and a replay sends zeros for the payload.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define CAPTURE_MAGIC "WIREDRC1"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_RECORD_LEN 13
+
+typedef enum {
+	CAPTURE_CONNECT = 1, // A client connected, or was handed over already past its hello
+	CAPTURE_FRAME,	     // payload = one inbound frame
+	CAPTURE_CLOSE,	     // The connection went away
+} CaptureKind;
+
+typedef struct {
+	uint8_t kind;
+	uint32_t conn; // Numbered from 1 in the order they connected
+	uint32_t delayUs; // Saturates, the server gives up long before
+	uint32_t len;
+} CaptureRecord;
+
+static inline void packRecord(char* out, const CaptureRecord* record)
+{
+	uint32_t conn = htobe32(record->conn);
+	uint32_t delay = htobe32(record->delayUs);
+	uint32_t len = htobe32(record->len);
+
+	out[0] = record->kind;
+	memcpy(out + 1, &conn, sizeof(conn));
+	memcpy(out + 5, &delay, sizeof(delay));
+	memcpy(out + 9, &len, sizeof(len));
+}
+
+static inline void unpackRecord(const char* in, CaptureRecord* record)
+{
+	uint32_t conn, delay, len;
+	memcpy(&conn, in + 1, sizeof(conn));
+	memcpy(&delay, in + 5, sizeof(delay));
+	memcpy(&len, in + 9, sizeof(len));
+
+	record->kind = in[0];
+	record->conn = be32toh(conn);
+	record->delayUs = be32toh(delay);
+	record->len = be32toh(len);
+}
@@ -0,0 +1,109 @@
+/*
+ * Wire format shared by the server and the client.
+ *
+ * Every frame is a FRAME_HEADER_LEN byte header followed by len bytes of payload:
+ *
+ *	u8 type | u8 flags | u16 reserved | u32 len | u64 seq | u64 aux
+ *
+ * All integers are big endian. What seq and aux mean depends on the type.
+ *
+ * A server with a multicast group publishes every relayed message there once, as a
+ * datagram holding a u64 origin followed by the FRAME_MSG. Clients that joined the
+ * group get no TCP copy and ask for whatever datagrams went missing with FRAME_RESEND.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define PROTOCOL_VERSION 1
+
+#define MAX_BUFFER_SIZE 1024 // Longest text message, and every other non-chunk payload
+#define MAX_NAME_LEN 30
+#define FILE_CHUNK_SIZE (16 * 1024)
+#define MAX_FRAME_PAYLOAD FILE_CHUNK_SIZE
+#define FRAME_HEADER_LEN 24
+#define MULTICAST_HEADER_LEN 8 // Origin in front of the frame in a datagram
+#define MAX_GROUP_LEN 21 // "255.255.255.255:65535"
+#define MULTICAST_HEARTBEAT_MS 1000 // Longest a group stays quiet, clients that hear nothing for a while leave it
+
+typedef enum {
+	FRAME_HELLO = 1, // client -> server: flags = PROTOCOL_VERSION | HELLO_RESUME once welcomed before,
+			 // seq = last server seq seen, aux = session id, payload = name
+	FRAME_WELCOME,	 // server -> client: seq = newest server seq, aux = last client seq accepted for the session
+	FRAME_FULL,	 // server -> client: no room, the connection gets closed
+	FRAME_MSG,	 // client -> server: seq = client seq. server -> client: seq = server seq, aux = when the server
+			 // got it (CLOCK_REALTIME microseconds). payload = text
+	FRAME_ACK,	 // server -> client: seq = client seq, aux = server seq it was relayed as
+	FRAME_FILE_BEGIN, // client -> server: seq = file size, aux = client transfer id, payload = file name.
+			  // server -> client: aux = server transfer id, payload = sender name '\0' file name
+	FRAME_FILE_CHUNK, // seq = offset, aux = transfer id, payload = up to FILE_CHUNK_SIZE bytes of the file
+	FRAME_FILE_ABORT, // aux = transfer id, flags = FILE_ABORT_OWN when it is the receiver's own upload,
+			  // FILE_ABORT_BEHIND when only this receiver was dropped from it. client -> server:
+			  // our own upload, or with FILE_ABORT_DECLINE a download we don't want
+	FRAME_DIRECT,	  // client -> server: seq = client seq, payload = target name '\0' text.
+			  // server -> client: aux = when the server got it, like FRAME_MSG, payload = sender name '\0' text
+	FRAME_WHO,	  // client -> server: seq = client seq, asks who is online.
+			  // server -> client: seq = users online, payload = '\n' separated names, as many as fit
+	FRAME_NOTICE,	  // server -> client: payload = text from the server itself
+	FRAME_NAME_TAKEN, // server -> client: somebody else has the name, the connection gets closed
+	FRAME_GAP,	  // server -> client: messages seq to aux were dropped because the client fell behind
+	FRAME_MULTICAST,  // server -> client: right after FRAME_WELCOME, seq = origin of our own messages in the datagrams,
+			  // payload = group "address:port". client -> server: joined and heard the group, relayed
+			  // messages can stop. With MULTICAST_LEAVE: the group went quiet, seq = last message
+			  // seen, relay everything after it over TCP again. datagram: heartbeat, seq = newest
+			  // message published
+	FRAME_RESEND,	  // client -> server: send messages seq to aux again, their datagrams never arrived
+} FrameType;
+
+#define HELLO_RESUME 0x80 // Reconnecting, seq counts even when it's 0
+#define MULTICAST_LEAVE 1
+#define FILE_ABORT_OWN 1
+#define FILE_ABORT_BEHIND 2 // The receiver fell too far behind the sender
+#define FILE_ABORT_DECLINE 4 // Receiver turns the file down, the rest of its chunks can skip it
+
+typedef struct {
+	uint8_t type;
+	uint8_t flags;
+	uint32_t len;
+	uint64_t seq;
+	uint64_t aux;
+} FrameHeader;
+
+static inline void packHeader(char* out, const FrameHeader* header)
+{
+	uint16_t reserved = 0;
+	uint32_t len = htobe32(header->len);
+	uint64_t seq = htobe64(header->seq);
+	uint64_t aux = htobe64(header->aux);
+
+	out[0] = header->type;
+	out[1] = header->flags;
+	memcpy(out + 2, &reserved, sizeof(reserved));
+	memcpy(out + 4, &len, sizeof(len));
+	memcpy(out + 8, &seq, sizeof(seq));
+	memcpy(out + 16, &aux, sizeof(aux));
+}
+
+static inline void unpackHeader(const char* in, FrameHeader* header)
+{
+	uint32_t len;
+	uint64_t seq, aux;
+	memcpy(&len, in + 4, sizeof(len));
+	memcpy(&seq, in + 8, sizeof(seq));
+	memcpy(&aux, in + 16, sizeof(aux));
+
+	header->type = in[0];
+	header->flags = in[1];
+	header->len = be32toh(len);
+	header->seq = be64toh(seq);
+	header->aux = be64toh(aux);
+}
+
+static inline bool checkFrameLength(const FrameHeader* header) // Only chunks may be longer than any text buffer
+{
+	return header->len <= (header->type == FRAME_FILE_CHUNK ? FILE_CHUNK_SIZE : MAX_BUFFER_SIZE);
+}
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "ansi_colors.h"
+#include "protocol.h"
+#include "capture.h"
+
+// Drives a server with a capture made by server -r: every recorded connection gets
+// its own socket and sends the same frames, at the recorded pace or as fast as the
+// server takes them, then we report throughput and latency.
+
+#define DEFAULT_PORT 8080
+#define OUT_HIGH_WATER (1024 * 1024) // Stop issuing records while a connection has this much unsent
+#define DRAIN_MS 2000 // How long to wait for the last answers once everything is sent
+#define RECV_SIZE (64 * 1024)
+
+typedef struct {
+	uint64_t seq;
+	uint64_t sentUs;
+} Pending;
+
+typedef struct {
+	int fd; // -1 before it connects and after it's gone
+	bool closing; // Recorded close, waits for the output to get out and the acks to come back
+	char* out;
+	size_t outLen;
+	size_t outOffset;
+	size_t outCap;
+	char* in;
+	uint32_t inLen;
+	Pending* pending; // Frames the server acks, oldest first
+	size_t pendingHead;
+	size_t pendingCount;
+	size_t pendingCap;
+} Peer;
+
+typedef struct {
+	uint32_t* us;
+	size_t count;
+	size_t cap;
+} Samples;
+
+typedef struct {
+	const char* data; // The capture, mapped
+	size_t size;
+	size_t pos;
+	uint64_t at; // us into the capture of the next record
+	double speed; // 0 for as fast as possible
+
+	struct sockaddr_in addr;
+	Peer* peers; // Indexed by recorded connection id
+	uint32_t peerCount;
+	int open;
+	uint64_t startUs;
+	uint64_t sessionSalt; // New every run, so the server doesn't take us for the sessions it already knows
+
+	uint64_t records;
+	uint64_t framesSent;
+	uint64_t bytesSent;
+	uint64_t framesReceived;
+	uint64_t bytesReceived;
+	uint64_t connectFailed;
+	uint64_t rejected; // FULL or NAME_TAKEN
+	uint64_t skipped; // Frames for connections that were already gone
+	uint64_t lastActivityUs; // Last frame either way
+	Samples ackUs; // Queued to acked
+	Samples deliveryUs; // Server stamp to arrival of relayed messages
+} Replay;
+
+static uint64_t monotonicUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t wallClockUs(void) // Same clock the server stamps messages with
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool grow(void** array, size_t* cap, size_t need, size_t size)
+{
+	if (need <= *cap)
+		return true;
+
+	size_t new_cap = *cap ? *cap : 64;
+	while (new_cap < need)
+		new_cap *= 2;
+	void* grown = realloc(*array, new_cap * size);
+	if (!grown)
+		return false;
+	*array = grown;
+	*cap = new_cap;
+	return true;
+}
+
+static void addSample(Samples* samples, uint64_t us)
+{
+	if (grow((void**)&samples->us, &samples->cap, samples->count + 1, sizeof(uint32_t)))
+		samples->us[samples->count++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static int compareSamples(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void printSamples(const char* what, Samples* samples)
+{
+	if (samples->count == 0) {
+		printf("%-10s no samples\n", what);
+		return;
+	}
+
+	qsort(samples->us, samples->count, sizeof(uint32_t), compareSamples);
+	uint64_t sum = 0;
+	for (size_t s = 0; s < samples->count; s++)
+		sum += samples->us[s];
+
+	#define PERCENTILE(p) (samples->us[(size_t)((samples->count - 1) * (p))] / 1000.0)
+	printf("%-10s %zu samples, avg %.3f p50 %.3f p99 %.3f p99.9 %.3f max %.3f ms\n", what, samples->count,
+	       sum / 1000.0 / samples->count, PERCENTILE(0.5), PERCENTILE(0.99), PERCENTILE(0.999), PERCENTILE(1.0));
+	#undef PERCENTILE
+}
+
+static Peer* getPeer(Replay* replay, uint32_t id)
+{
+	if (id >= replay->peerCount) {
+		uint32_t count = replay->peerCount ? replay->peerCount : 64;
+		while (count <= id)
+			count *= 2;
+		Peer* peers = realloc(replay->peers, count * sizeof(Peer));
+		if (!peers)
+			return NULL;
+		memset(peers + replay->peerCount, 0, (count - replay->peerCount) * sizeof(Peer));
+		for (uint32_t p = replay->peerCount; p < count; p++)
+			peers[p].fd = -1;
+		replay->peers = peers;
+		replay->peerCount = count;
+	}
+	return &replay->peers[id];
+}
+
+static void closePeer(Replay* replay, Peer* peer)
+{
+	if (peer->fd == -1)
+		return;
+
+	close(peer->fd);
+	peer->fd = -1;
+	peer->outLen = peer->outOffset = 0;
+	peer->inLen = 0;
+	peer->pendingHead = peer->pendingCount = 0;
+	replay->open--;
+}
+
+static void connectPeer(Replay* replay, Peer* peer)
+{
+	closePeer(replay, peer); // A recorded id connects once, but a bad capture shouldn't leak
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&replay->addr, sizeof(replay->addr)) == -1) {
+		if (fd != -1)
+			close(fd);
+		replay->connectFailed++;
+		return;
+	}
+
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // We measure the server, not Nagle
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if (!peer->in && !(peer->in = malloc(FRAME_HEADER_LEN + MAX_FRAME_PAYLOAD))) {
+		close(fd);
+		replay->connectFailed++;
+		return;
+	}
+	peer->fd = fd;
+	peer->closing = false;
+	replay->open++;
+}
+
+static bool flushPeer(Replay* replay, Peer* peer) // Return false if the connection broke
+{
+	while (peer->outOffset < peer->outLen) {
+		ssize_t snd = send(peer->fd, peer->out + peer->outOffset, peer->outLen - peer->outOffset, MSG_NOSIGNAL);
+		if (snd == -1)
+			return errno == EAGAIN || errno == EINTR;
+		peer->outOffset += snd;
+		replay->bytesSent += snd;
+	}
+	peer->outLen = peer->outOffset = 0;
+
+	if (peer->closing && peer->pendingCount == 0)
+		closePeer(replay, peer);
+	return true;
+}
+
+static uint64_t freshSession(Replay* replay, uint64_t recorded) // Same recorded session, same id, so reconnects still resume
+{
+	uint64_t z = recorded ^ replay->sessionSalt; // splitmix64 finalizer
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static void sendRecorded(Replay* replay, Peer* peer, const char* frame, uint32_t len)
+{
+	FrameHeader header;
+	unpackHeader(frame, &header);
+
+	// File chunks were kept without their payload
+	size_t total = FRAME_HEADER_LEN + header.len;
+	if (total < len || !grow((void**)&peer->out, &peer->outCap, peer->outLen + total, 1)) {
+		replay->skipped++;
+		return;
+	}
+	memcpy(peer->out + peer->outLen, frame, len);
+	memset(peer->out + peer->outLen + len, 0, total - len);
+	if (header.type == FRAME_HELLO) { // The recorded session already sent all of this to the server
+		header.aux = freshSession(replay, header.aux);
+		packHeader(peer->out + peer->outLen, &header);
+	}
+	peer->outLen += total;
+	replay->framesSent++;
+
+	uint64_t now = monotonicUs();
+	replay->lastActivityUs = now;
+	bool acked = header.type == FRAME_MSG || header.type == FRAME_DIRECT || header.type == FRAME_WHO;
+	if (acked && grow((void**)&peer->pending, &peer->pendingCap, peer->pendingHead + peer->pendingCount + 1, sizeof(Pending)))
+		peer->pending[peer->pendingHead + peer->pendingCount++] = (Pending){ header.seq, now };
+
+	if (!flushPeer(replay, peer))
+		closePeer(replay, peer);
+}
+
+static void handleAck(Replay* replay, Peer* peer, uint64_t seq)
+{
+	uint64_t now = monotonicUs();
+	while (peer->pendingCount > 0 && peer->pending[peer->pendingHead].seq <= seq) {
+		Pending* p = &peer->pending[peer->pendingHead++];
+		peer->pendingCount--;
+		if (p->seq == seq)
+			addSample(&replay->ackUs, now - p->sentUs);
+	}
+	if (peer->pendingCount == 0) {
+		peer->pendingHead = 0;
+	} else if (peer->pendingHead > peer->pendingCount) { // Keep it from creeping along forever
+		memmove(peer->pending, peer->pending + peer->pendingHead, peer->pendingCount * sizeof(Pending));
+		peer->pendingHead = 0;
+	}
+
+	if (peer->closing && peer->pendingCount == 0 && peer->outOffset == peer->outLen)
+		closePeer(replay, peer);
+}
+
+static bool readPeer(Replay* replay, Peer* peer) // Return false if the connection broke
+{
+	const uint32_t capacity = FRAME_HEADER_LEN + MAX_FRAME_PAYLOAD;
+	char buffer[RECV_SIZE];
+
+	while (true) {
+		ssize_t rc = recv(peer->fd, buffer, sizeof(buffer), 0);
+		if (rc == 0)
+			return false;
+		if (rc == -1)
+			return errno == EAGAIN || errno == EINTR;
+		replay->bytesReceived += rc;
+		replay->lastActivityUs = monotonicUs();
+
+		// Only whole frames matter, so bytes are fed in as they fit
+		for (ssize_t used = 0; used < rc;) {
+			uint32_t take = capacity - peer->inLen < rc - used ? capacity - peer->inLen : rc - used;
+			memcpy(peer->in + peer->inLen, buffer + used, take);
+			peer->inLen += take;
+			used += take;
+
+			uint32_t offset = 0;
+			while (peer->inLen - offset >= FRAME_HEADER_LEN) {
+				FrameHeader header;
+				unpackHeader(peer->in + offset, &header);
+				if (!checkFrameLength(&header))
+					return false;
+				if (peer->inLen - offset < FRAME_HEADER_LEN + header.len)
+					break;
+				offset += FRAME_HEADER_LEN + header.len;
+				replay->framesReceived++;
+
+				if (header.type == FRAME_ACK) {
+					handleAck(replay, peer, header.seq);
+					if (peer->fd == -1) // That was the last one it waited for
+						return true;
+				} else if ((header.type == FRAME_MSG || header.type == FRAME_DIRECT) && header.aux > 0)
+					addSample(&replay->deliveryUs, wallClockUs() - header.aux);
+				else if (header.type == FRAME_FULL || header.type == FRAME_NAME_TAKEN)
+					replay->rejected++;
+			}
+			memmove(peer->in, peer->in + offset, peer->inLen - offset);
+			peer->inLen -= offset;
+		}
+	}
+}
+
+static bool canIssue(Replay* replay) // Keeps fast replays from buffering the whole capture
+{
+	for (uint32_t p = 0; p < replay->peerCount; p++) {
+		if (replay->peers[p].outLen - replay->peers[p].outOffset > OUT_HIGH_WATER)
+			return false;
+	}
+	return true;
+}
+
+static int issueDue(Replay* replay) // Sends every record that is due, returns ms until the next one or -1
+{
+	while (replay->pos < replay->size) {
+		if (replay->size - replay->pos < CAPTURE_RECORD_LEN) {
+			fprintf(stderr, RED "The capture ends halfway through a record\n" CRESET);
+			replay->pos = replay->size;
+			return -1;
+		}
+
+		CaptureRecord record;
+		unpackRecord(replay->data + replay->pos, &record);
+		if (record.len > replay->size - replay->pos - CAPTURE_RECORD_LEN) {
+			fprintf(stderr, RED "The capture ends halfway through a record\n" CRESET);
+			replay->pos = replay->size;
+			return -1;
+		}
+
+		if (replay->speed > 0) {
+			uint64_t due = replay->startUs + (uint64_t)((replay->at + record.delayUs) / replay->speed);
+			uint64_t now = monotonicUs();
+			if (due > now)
+				return (due - now + 999) / 1000;
+		} else if (!canIssue(replay)) {
+			return 1;
+		}
+
+		replay->at += record.delayUs;
+		replay->pos += CAPTURE_RECORD_LEN;
+		const char* payload = replay->data + replay->pos;
+		replay->pos += record.len;
+		replay->records++;
+
+		Peer* peer = getPeer(replay, record.conn);
+		if (!peer) {
+			replay->skipped++;
+			continue;
+		}
+
+		switch (record.kind) {
+		case CAPTURE_CONNECT:
+			connectPeer(replay, peer);
+			break;
+
+		case CAPTURE_FRAME:
+			if (peer->fd == -1 || peer->closing || record.len < FRAME_HEADER_LEN)
+				replay->skipped++;
+			else
+				sendRecorded(replay, peer, payload, record.len);
+			break;
+
+		case CAPTURE_CLOSE:
+			if (peer->fd != -1) {
+				peer->closing = true;
+				if (!flushPeer(replay, peer))
+					closePeer(replay, peer);
+			}
+			break;
+
+		default:
+			replay->skipped++;
+		}
+	}
+
+	return -1;
+}
+
+static bool waitingForAcks(Replay* replay)
+{
+	for (uint32_t p = 0; p < replay->peerCount; p++) {
+		Peer* peer = &replay->peers[p];
+		if (peer->fd != -1 && (peer->pendingCount > 0 || peer->outOffset < peer->outLen))
+			return true;
+	}
+	return false;
+}
+
+static void run(Replay* replay)
+{
+	struct pollfd* pfds = NULL;
+	uint32_t* owners = NULL;
+	size_t pfds_cap = 0, owners_cap = 0;
+
+	replay->startUs = monotonicUs();
+	while (true) {
+		int wait = issueDue(replay);
+		bool done = replay->pos >= replay->size;
+
+		// Once everything is out, stay until the answers are in or the server goes quiet
+		if (done && (!waitingForAcks(replay) || monotonicUs() - replay->lastActivityUs > DRAIN_MS * 1000ull))
+			break;
+		if (done)
+			wait = 100;
+
+		int count = 0;
+		if (!grow((void**)&pfds, &pfds_cap, replay->open + 1, sizeof(struct pollfd))
+		    || !grow((void**)&owners, &owners_cap, replay->open + 1, sizeof(uint32_t))) {
+			fprintf(stderr, RED "Out of memory\n" CRESET);
+			break;
+		}
+		for (uint32_t p = 0; p < replay->peerCount; p++) {
+			Peer* peer = &replay->peers[p];
+			if (peer->fd == -1)
+				continue;
+			pfds[count] = (struct pollfd){ .fd = peer->fd, .events = POLLIN | (peer->outOffset < peer->outLen ? POLLOUT : 0) };
+			owners[count++] = p;
+		}
+
+		if (poll(pfds, count, wait) == -1 && errno != EINTR) {
+			fprintf(stderr, RED "Poll failed! errno: %s\n" CRESET, strerror(errno));
+			break;
+		}
+
+		for (int c = 0; c < count; c++) {
+			Peer* peer = &replay->peers[owners[c]];
+			bool ok = true;
+			if (pfds[c].revents & (POLLIN | POLLHUP | POLLERR))
+				ok = readPeer(replay, peer);
+			if (ok && peer->fd != -1 && (pfds[c].revents & POLLOUT))
+				ok = flushPeer(replay, peer);
+			if (!ok)
+				closePeer(replay, peer);
+		}
+	}
+
+	free(pfds);
+	free(owners);
+}
+
+int main(int argc, char** argv)
+{
+	Replay replay = { .speed = 1 };
+	const char* host = "127.0.0.1";
+	unsigned short port = DEFAULT_PORT;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:s:")) != -1) {
+		switch (opt) {
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			replay.speed = atof(optarg);
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	if (optind != argc - 1 || port == 0 || replay.speed < 0) {
+		fprintf(stderr, "Usage: %s [-h server address] [-p port] [-s speed, 1 for the recorded pace, 0 for as fast as possible] capture\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	replay.addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(port) };
+	if (inet_pton(AF_INET, host, &replay.addr.sin_addr) != 1) {
+		fprintf(stderr, RED "Invalid address %s\n" CRESET, host);
+		return EXIT_FAILURE;
+	}
+
+	const char* path = argv[optind];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < CAPTURE_MAGIC_LEN) {
+		fprintf(stderr, RED "Couldn't read %s! errno: %s\n" CRESET, path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	replay.size = st.st_size;
+	replay.data = mmap(NULL, replay.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay.data == MAP_FAILED || memcmp(replay.data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+		fprintf(stderr, RED "%s isn't a capture!\n" CRESET, path);
+		return EXIT_FAILURE;
+	}
+	replay.pos = CAPTURE_MAGIC_LEN;
+	if (getrandom(&replay.sessionSalt, sizeof(replay.sessionSalt), 0) != sizeof(replay.sessionSalt))
+		replay.sessionSalt = ((uint64_t)time(NULL) << 32) ^ getpid();
+
+	run(&replay);
+	double seconds = (monotonicUs() - replay.startUs) / 1e6;
+	for (uint32_t p = 0; p < replay.peerCount; p++)
+		closePeer(&replay, &replay.peers[p]);
+
+	char speed[32] = "as fast as possible";
+	if (replay.speed > 0)
+		snprintf(speed, sizeof(speed), "at %gx", replay.speed);
+	printf("Replayed %llu records of %s %s in %.3f s, %.3f s recorded\n", (unsigned long long)replay.records, path,
+	       speed, seconds, replay.at / 1e6);
+	printf("Sent      %llu frames, %.1f frames/s, %.2f MiB/s\n", (unsigned long long)replay.framesSent,
+	       replay.framesSent / seconds, replay.bytesSent / seconds / (1 << 20));
+	printf("Received  %llu frames, %.1f frames/s, %.2f MiB/s\n", (unsigned long long)replay.framesReceived,
+	       replay.framesReceived / seconds, replay.bytesReceived / seconds / (1 << 20));
+	printSamples("Acks", &replay.ackUs);
+	printSamples("Delivery", &replay.deliveryUs);
+	if (replay.connectFailed || replay.rejected || replay.skipped)
+		printf(YEL "%llu connections failed, %llu rejected, %llu records skipped\n" CRESET, (unsigned long long)replay.connectFailed,
+		       (unsigned long long)replay.rejected, (unsigned long long)replay.skipped);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+/*
+ * Text sanitizing, shared by the server and the client.
+ *
+ * Everything shown as text is valid UTF-8 without terminal controls. The server cleans
+ * what it relays; the client cleans datagrams, which never went through the server's checks.
+ * Runs of printable ASCII are skipped 16 or 32 bytes at a time, only the bytes around
+ * anything else go through the scalar decoder. Call initSanitizer() once at startup.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static inline uint32_t printablePrefixScalar(const char* in, uint32_t len)
+{
+	uint32_t i = 0;
+	while (i < len && (unsigned char)in[i] >= 0x20 && (unsigned char)in[i] < 0x7f)
+		i++;
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static inline uint32_t printablePrefixSse2(const char* in, uint32_t len)
+{
+	const __m128i space = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	uint32_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		// Signed compare, so bytes >= 0x80 fail it along with the C0 controls
+		__m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, space));
+		unsigned mask = _mm_movemask_epi8(ok);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + printablePrefixScalar(in + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t printablePrefixAvx2(const char* in, uint32_t len)
+{
+	const __m256i space = _mm256_set1_epi8(0x1f);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	uint32_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+		__m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, space));
+		unsigned mask = _mm256_movemask_epi8(ok);
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + printablePrefixScalar(in + i, len - i);
+}
+#endif
+
+static uint32_t (*printablePrefix)(const char* in, uint32_t len) = printablePrefixScalar;
+
+static inline void initSanitizer(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		printablePrefix = printablePrefixAvx2;
+	else if (__builtin_cpu_supports("sse2"))
+		printablePrefix = printablePrefixSse2;
+#endif
+}
+
+static inline uint32_t decodeUtf8(const unsigned char* in, uint32_t len, uint32_t* cp) // Length of a valid sequence or 0
+{
+	unsigned char c = in[0];
+	uint32_t n, min;
+
+	if (c >= 0xc2 && c <= 0xdf) { n = 2; min = 0x80; *cp = c & 0x1f; }
+	else if (c >= 0xe0 && c <= 0xef) { n = 3; min = 0x800; *cp = c & 0x0f; }
+	else if (c >= 0xf0 && c <= 0xf4) { n = 4; min = 0x10000; *cp = c & 0x07; }
+	else return 0;
+
+	if (len < n)
+		return 0;
+
+	for (uint32_t k = 1; k < n; k++) {
+		if ((in[k] & 0xc0) != 0x80)
+			return 0;
+		*cp = (*cp << 6) | (in[k] & 0x3f);
+	}
+
+	// Overlong forms, UTF-16 surrogates and anything past U+10FFFF
+	if (*cp < min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+		return 0;
+	return n;
+}
+
+static inline bool isDangerousCodepoint(uint32_t cp)
+{
+	return (cp >= 0x80 && cp <= 0x9f) ||	   // C1 controls, 0x9b starts a CSI on its own
+	       (cp >= 0x202a && cp <= 0x202e) ||   // Bidi embeddings and overrides
+	       (cp >= 0x2066 && cp <= 0x2069);	   // Bidi isolates
+}
+
+static inline uint32_t skipEscape(const unsigned char* in, uint32_t len) // Length of the ESC sequence at in
+{
+	if (len < 2)
+		return len;
+
+	uint32_t i = 2;
+	switch (in[1]) {
+	case '[': // CSI: parameters, intermediates, final byte
+		while (i < len && in[i] >= 0x20 && in[i] <= 0x3f)
+			i++;
+		return i < len && in[i] >= 0x40 && in[i] <= 0x7e ? i + 1 : i;
+
+	case ']': case 'P': case 'X': case '^': case '_': // Strings up to BEL or ESC '\'
+		while (i < len && in[i] != 0x07 && in[i] != 0x1b)
+			i++;
+		if (i < len && in[i] == 0x1b && i + 1 < len && in[i + 1] == '\\')
+			return i + 2;
+		return i < len && in[i] == 0x07 ? i + 1 : i;
+
+	default:
+		return in[1] >= 0x20 && in[1] <= 0x7e ? 2 : 1;
+	}
+}
+
+// Copies in to out as valid UTF-8 without control or escape sequences and returns the new length.
+// Invalid bytes become U+FFFD, the output stops at a character boundary before cap.
+static inline uint32_t sanitizeText(char* out, uint32_t cap, const char* in, uint32_t len, bool multiline)
+{
+	const unsigned char* src = (const unsigned char*)in;
+	uint32_t i = 0, o = 0;
+
+	while (i < len) {
+		uint32_t run = printablePrefix(in + i, len - i);
+		if (run > cap - o)
+			run = cap - o;
+		memcpy(out + o, in + i, run);
+		i += run;
+		o += run;
+		if (i == len || o == cap)
+			break;
+
+		unsigned char c = src[i];
+		if (c == 0x1b) {
+			i += skipEscape(src + i, len - i);
+		} else if (c < 0x80) { // C0 controls and DEL
+			if (multiline && (c == '\n' || c == '\t'))
+				out[o++] = c;
+			i++;
+		} else {
+			uint32_t cp;
+			uint32_t n = decodeUtf8(src + i, len - i, &cp);
+			if (n == 0) {
+				if (o + 3 > cap)
+					break;
+				memcpy(out + o, "\xef\xbf\xbd", 3); // U+FFFD
+				o += 3;
+				i++;
+			} else {
+				if (!isDangerousCodepoint(cp)) {
+					if (o + n > cap)
+						break;
+					memcpy(out + o, src + i, n);
+					o += n;
+				}
+				i += n;
+			}
+		}
+	}
+
+	return o;
+}
@@ -1,6 +1,15 @@
+#define _GNU_SOURCE // splice() and tee()
+
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -8,8 +17,12 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
-
+#include <strings.h>
+#include <stdlib.h>
 #include "ansi_colors.h"
+#include "protocol.h"
+#include "capture.h"
+#include "sanitize.h"
 
 // Simple logging
 static void printError(const char* format, ...)
@@ -112,12 +125,363 @@ void printResult(Result s)
 } while(0)
 
 #define PORT 8080
-#define MAX_CLIENTS 4
-#define BACKLOG 10
-#define MAX_BUFFER_SIZE 1024
-#define MAX_NAME_LEN 30
+#define DEFAULT_MAX_CLIENTS 4 // -c
+#define BACKLOG SOMAXCONN // Thousands of clients come back at once after a network blip
+#define HISTORY_SIZE 1024 // Relayed messages kept for clients catching up after a reconnect
+#define DEFAULT_LAG_KB 1024 // -l, output a client may have queued before the lag policy kicks in
+#define DEFAULT_LAG_SECONDS 30 // -t, a client whose oldest output waited longer gets dropped, 0 turns it off
+#define LAG_CHECK_MS 1000
+#define BUSY_POLL_US 50 // SO_BUSY_POLL on client sockets in low latency mode
+#define SPINS_BEFORE_YIELD 1000 // Empty polls in a row before the spinning loop starts yielding the CPU
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+#define CAPTURE_FLUSH_MS 1000 // A quiet server still gets its capture on disk
+#define HANDOFF_MAGIC 0x5749524544484f46ull // "WIREDHOF"
+#define HANDOFF_VERSION 1 // Bump it when a handoff record changes
+#define HANDOFF_HEADER_LEN (8 + 4 + 3 * 8 + 2 * 4 + MAX_GROUP_LEN + 1)
+#define HANDOFF_ENTRY_LEN (3 * 8 + 4)
+#define HANDOFF_CONN_LEN (MAX_NAME_LEN + 1 + 2 + 7 * 8 + 3 * 4)
+#define HANDOFF_PACKET (HANDOFF_CONN_LEN + FRAME_HEADER_LEN + MAX_BUFFER_SIZE) // Largest one, a record and what follows it
+#define HANDOFF_TIMEOUT_SEC 5
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define MAX_READS_PER_WAKEUP 16 // Keeps one busy client from starving the others
+#define MAX_UPLOADS 4 // Concurrent file uploads per connection
+#define FILE_PIPE_SIZE (8 * FILE_CHUNK_SIZE) // A page slot per 512 bytes of chunk, for however fragmented it arrives
+#define MAX_CUT_TRANSFERS 16 // Transfers a receiver fell behind on, their later chunks skip it
+#define DEFAULT_MEMORY_BUDGET_MB 64 // -m, caps every buffer queued or held for clients
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// Memory pools: every buffer on the relay path comes out of a size class. Slabs are
+// carved on first use and kept, so a warm server relays without calling malloc and
+// the total can't grow past the budget no matter how many clients fall behind.
+typedef struct PoolBlock {
+	struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct {
+	uint32_t size;
+	PoolBlock* free;
+	size_t slabs;
+	size_t used; // Blocks handed out
+	size_t peak;
+} Pool;
+
+static Pool pools[] = { { .size = 32 }, { .size = 128 }, { .size = 512 }, { .size = 2048 }, { .size = RECV_BUFFER_SIZE } };
+#define POOL_COUNT (sizeof(pools) / sizeof(pools[0]))
+
+static size_t memoryBudget = (size_t)DEFAULT_MEMORY_BUDGET_MB << 20;
+static size_t memoryReserved; // Bytes in slabs
+static uint64_t memoryRefused; // Allocations the budget turned down
+
+static Pool* poolFor(size_t size)
+{
+	for (size_t p = 0; p < POOL_COUNT; p++) {
+		if (size <= pools[p].size)
+			return &pools[p];
+	}
+	return NULL;
+}
+
+static bool growPool(Pool* pool)
+{
+	size_t slab_size = pool->size > POOL_SLAB_SIZE ? pool->size : POOL_SLAB_SIZE;
+	if (memoryReserved + slab_size > memoryBudget)
+		return false;
+
+	char* slab = malloc(slab_size);
+	if (!slab)
+		return false;
+
+	for (size_t offset = 0; offset + pool->size <= slab_size; offset += pool->size) {
+		PoolBlock* block = (PoolBlock*)(slab + offset);
+		block->next = pool->free;
+		pool->free = block;
+	}
+	pool->slabs++;
+	memoryReserved += slab_size;
+	return true;
+}
+
+static void* poolAlloc(size_t size)
+{
+	Pool* pool = poolFor(size);
+	if (!pool || (!pool->free && !growPool(pool))) {
+		memoryRefused++;
+		return NULL;
+	}
+
+	PoolBlock* block = pool->free;
+	pool->free = block->next;
+	if (++pool->used > pool->peak)
+		pool->peak = pool->used;
+	return block;
+}
+
+static void poolFree(void* ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	Pool* pool = poolFor(size);
+	PoolBlock* block = ptr;
+	block->next = pool->free;
+	pool->free = block;
+	pool->used--;
+}
+
+static uint64_t monotonicUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t wallClockUs(void) // Relayed messages carry when we got them, clients measure against it
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Trace points around the phases of the event loop, only built with -DWIRED_TRACE
+// (make servertrace). Spans go into a per-thread ring and kill -USR2 dumps it as
+// Chrome trace-event JSON, for chrome://tracing or Perfetto.
+#ifdef WIRED_TRACE
+#define TRACE_RING_SIZE 65536 // Spans kept per thread, the oldest get overwritten
+
+typedef struct {
+	const char* name;
+	uint64_t startNs;
+	uint64_t durNs;
+	int64_t arg;
+} TraceSpan;
+
+static __thread TraceSpan* traceRing;
+static __thread uint64_t traceCount;
+static int traceDumps;
+
+static uint64_t traceNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void traceRecord(const char* name, uint64_t start_ns, int64_t arg)
+{
+	if (!traceRing && !(traceRing = malloc(TRACE_RING_SIZE * sizeof(TraceSpan))))
+		return;
+
+	traceRing[traceCount++ % TRACE_RING_SIZE] = (TraceSpan){ name, start_ns, traceNow() - start_ns, arg };
+}
+
+static void traceDump(void) // The calling thread's ring, oldest span first
+{
+	char path[64];
+	snprintf(path, sizeof(path), "wired-trace-%d-%d.json", getpid(), ++traceDumps);
+	FILE* out = fopen(path, "we");
+	if (!out) {
+		printError("Couldn't write the trace to %s => errno:%s\n", path, strerror(errno));
+		return;
+	}
+
+	int pid = getpid(), tid = gettid();
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"event loop\"}}", pid, tid);
+	uint64_t first = traceCount > TRACE_RING_SIZE ? traceCount - TRACE_RING_SIZE : 0;
+	for (uint64_t n = first; n < traceCount; n++) {
+		TraceSpan* span = &traceRing[n % TRACE_RING_SIZE];
+		fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"args\":{\"arg\":%lld}}",
+			span->name, pid, tid,
+			(unsigned long long)(span->startNs / 1000), (unsigned long long)(span->startNs % 1000),
+			(unsigned long long)(span->durNs / 1000), (unsigned long long)(span->durNs % 1000), (long long)span->arg);
+	}
+	fprintf(out, "\n]}\n");
+
+	if (fclose(out) == 0)
+		printMsg("Trace of %llu spans written to %s\n", (unsigned long long)(traceCount - first), path);
+}
+
+#define TRACE_BEGIN(span) uint64_t span##TraceStart = traceNow()
+#define TRACE_END(span, arg) traceRecord(#span, span##TraceStart, (arg))
+#else
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, arg) do {} while (0)
+#endif
+
+// Frames are built once and shared by every queue and the history
+typedef struct {
+	int refs;
+	uint32_t len;
+	char data[];
+} Frame;
+
+static Frame* newFrame(uint8_t type, uint64_t seq, uint64_t aux, const char* payload, uint32_t len)
+{
+	Frame* frame = poolAlloc(sizeof(Frame) + FRAME_HEADER_LEN + len);
+	if (!frame) {
+		printError("Couldn't allocate a frame of %u bytes!\n", len);
+		return NULL;
+	}
 
-#define SERVER_FULL_STRING "[SERVERISFULL]"
+	FrameHeader header = { .type = type, .len = len, .seq = seq, .aux = aux };
+	packHeader(frame->data, &header);
+	if (len > 0)
+		memcpy(frame->data + FRAME_HEADER_LEN, payload, len);
+
+	frame->refs = 1;
+	frame->len = FRAME_HEADER_LEN + len;
+	return frame;
+}
+
+static void releaseFrame(Frame* frame)
+{
+	if (frame && --frame->refs == 0)
+		poolFree(frame, sizeof(Frame) + frame->len);
+}
+
+typedef struct Output {
+	Frame* frame;
+	uint64_t queuedAt; // ms, for lag tracking
+	struct Output* next;
+} Output;
+
+// What happens to a receiver that has more than the lag limit queued
+typedef enum {
+	LAG_DISCONNECT, // Drop the client
+	LAG_DROP_OLDEST, // Make room by dropping the oldest queued messages
+	LAG_DROP_NEWEST, // Drop what doesn't fit and tell the client how much it missed
+} LagPolicy;
+
+static const char* lagPolicyNames[] = { "disconnect", "drop-oldest", "drop-newest" };
+
+typedef struct {
+	uint64_t id; // Server wide, 0 when the slot is free
+	uint64_t clientId;
+	uint64_t size;
+	uint64_t received;
+} Upload;
+
+typedef struct {
+	char name[MAX_NAME_LEN + 1];
+	uint64_t session;
+	uint64_t lastClientSeq;
+	bool ready; // Said hello
+
+	char* in; // Partial inbound frame, only allocated while one is pending
+	uint32_t inLen;
+
+	Output* outHead;
+	Output* outTail;
+	uint32_t outOffset; // Bytes of outHead already sent
+	size_t outBytes;
+
+	// File chunks never pass through user space: the payload is spliced from the
+	// sender's socket into stage, tee'd into every receiver's bulk pipe and spliced
+	// from there into the receiver's socket.
+	Upload uploads[MAX_UPLOADS];
+	int activeUploads;
+	int stage[2];
+	FrameHeader chunk; // Inbound chunk being staged
+	int chunkUpload; // Index into uploads, the array moves when fds get compressed
+	uint32_t chunkHave;
+	bool chunkPending;
+	int bulk[2]; // Holds at most one outbound chunk frame
+	uint32_t bulkLeft;
+	bool bulkLast; // Nothing follows the chunk in bulk, the pipe goes once it's out
+	bool bulkStarted; // Text can't go out until the chunk is done
+	uint64_t bulkSince; // ms the chunk in bulk was queued at
+	uint64_t cut[MAX_CUT_TRANSFERS]; // Transfers dropped for it, newest overwrites oldest
+	uint32_t cutNext;
+
+	// Lag accounting
+	bool backlogged; // Has output the kernel didn't take yet
+	uint64_t gapFrom, gapTo; // Messages dropped since the last one that got through
+	uint64_t dropped;
+	size_t peakBytes;
+
+	bool multicast; // Joined the group, relayed messages only go out there
+	uint64_t origin; // Marks its messages in the datagrams
+
+	uint32_t captureId;
+} Connection;
+
+typedef struct {
+	uint64_t seq;
+	uint64_t session;
+	uint64_t clientSeq;
+	Frame* frame;
+} HistoryEntry;
+
+// Open addressing with linear probing, keyed by the ASCII case folded name
+typedef struct {
+	char name[MAX_NAME_LEN + 1];
+	int conn; // 0 when free, fds[0] is the listening socket so no user has it
+} NameSlot;
+
+typedef struct {
+	uint64_t session;
+	uint64_t clientSeq; // Newest frame of any kind we accepted from it
+} SessionSlot;
+
+typedef struct HandoffPacket {
+	struct HandoffPacket* next;
+	Frame* frame; // A queued frame goes as it is, anything else is in data
+	int fd; // Rides along unless it's -1
+	uint32_t len;
+	char data[];
+} HandoffPacket;
+
+typedef struct {
+	int server_socket;
+	int handoff_socket; // -1 unless -u was given
+	int handoffPeer; // New server taking over, -1 unless a handoff is under way
+	uint64_t handoffDeadline; // ms
+	HandoffPacket* handoffHead; // Still to send
+	HandoffPacket* handoffTail;
+	int listeners; // fds[0] is server_socket, fds[1] handoff_socket if there is one
+	int nfds;
+	int max_clients;
+	struct pollfd* fds; // max_clients + listeners
+	Connection* conns; // conns[i] belongs to fds[i]
+	bool compress_array;
+	NameSlot* names; // Name of every connection that said hello
+	uint32_t nameMask; // Index size - 1, a power of two at least twice max_clients
+	SessionSlot* sessions; // Where closed connections left off, as many as names, direct mapped by session id
+
+	uint64_t seq; // Last relayed message
+	HistoryEntry history[HISTORY_SIZE]; // Indexed by seq % HISTORY_SIZE
+
+	LagPolicy lagPolicy;
+	size_t lagBytes;
+	uint64_t lagMs;
+	uint64_t now; // ms, updated once per wakeup
+	uint64_t lastActivity; // ms, the server ends after a long enough quiet spell
+	uint64_t lagCheckedAt;
+	int busyCpu; // -1 unless -b, then the loop spins on that CPU instead of sleeping in poll()
+	int idleSpins;
+	int backlogged; // Connections with output pending
+	uint64_t lagDropped;
+	uint64_t lagDisconnects;
+
+	int mcast_socket; // -1 unless -g
+	struct sockaddr_in mcastAddr;
+	char mcastGroup[MAX_GROUP_LEN + 1]; // What clients join, "address:port"
+	uint64_t nextOrigin;
+	uint64_t publishedAt; // ms, last datagram
+	uint64_t published;
+	uint64_t publishFailed; // Went to every client over TCP instead
+
+	FILE* capture; // NULL unless -r
+	uint64_t capturedAt; // us, last record
+	uint32_t nextCaptureId;
+	bool captureDirty; // Records stdio hasn't written yet
+
+	uint64_t nextTransfer;
+	int devnull; // Where staged chunks go once every receiver has them
+
+	char recv_buffer[RECV_BUFFER_SIZE];
+	char clean_buffer[MAX_BUFFER_SIZE]; // Sanitized copy of the payload being relayed
+} Server;
 
 // Server
 static Result initServer(int* server_socket)
@@ -166,49 +530,483 @@ static Result initServer(int* server_socket)
 	return SUCCESS;
 }
 
-static bool sendMsg(char* send_buffer, int socket, const char* format, ...)
+static void initConnection(Connection* conn)
 {
-	va_list args;
-	va_start(args, format);
-	vsnprintf(send_buffer, MAX_BUFFER_SIZE, format, args);
-	va_end(args);
+	memset(conn, 0, sizeof(*conn));
+	conn->stage[0] = conn->stage[1] = -1;
+	conn->bulk[0] = conn->bulk[1] = -1;
+}
+
+static void closePipe(int fds[2])
+{
+	if (fds[0] == -1)
+		return;
+	close(fds[0]);
+	close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
+
+static bool openPipe(int fds[2])
+{
+	if (fds[0] != -1)
+		return true;
+
+	if (pipe2(fds, O_NONBLOCK) == -1) {
+		printError("Couldn't create a pipe => errno:%s\n", strerror(errno));
+		fds[0] = fds[1] = -1;
+		return false;
+	}
 
-	int snd = send(socket, send_buffer, strlen(send_buffer), 0);
-	if (snd == -1) {
-		printError("send error: %s\n", strerror(errno));
+	// Past pipe-user-pages-soft new pipes stay small and tee() would come back short
+	if (fcntl(fds[0], F_SETPIPE_SZ, FILE_PIPE_SIZE) == -1) {
+		printWarning("Couldn't grow a pipe to %d bytes => errno:%s\n", FILE_PIPE_SIZE, strerror(errno));
+		closePipe(fds);
 		return false;
 	}
 	return true;
 }
 
-static void sendToAll(char* send_buffer, int client_socket, int server_socket, struct pollfd* fds, int nfds, const char* format, ...)
+static void releaseBulkPipe(Connection* receiver) // Closed once the chunk in it is out, the next one opens it again
 {
-	va_list args;
-	va_start(args, format);
-	vsnprintf(send_buffer, MAX_BUFFER_SIZE, format, args);
-	va_end(args);
+	if (receiver->bulkLeft > 0)
+		receiver->bulkLast = true;
+	else
+		closePipe(receiver->bulk);
+}
+
+static void releaseBulkPipes(Server* server) // A transfer was cut short, receivers let go of their pipes
+{
+	for (int r = 0; r < server->nfds; r++)
+		releaseBulkPipe(&server->conns[r]);
+}
+
+// Name index
+static uint32_t hashName(const char* name)
+{
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (; *name; name++) {
+		char c = *name;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	}
+	return hash;
+}
+
+static int findName(Server* server, const char* name) // Slot holding name or -1
+{
+	uint32_t mask = server->nameMask;
+	for (uint32_t slot = hashName(name) & mask;; slot = (slot + 1) & mask) {
+		if (server->names[slot].conn == 0)
+			return -1;
+		if (strcasecmp(server->names[slot].name, name) == 0)
+			return slot;
+	}
+}
+
+static void addName(Server* server, const char* name, int conn)
+{
+	uint32_t mask = server->nameMask;
+	uint32_t slot = hashName(name) & mask;
+	while (server->names[slot].conn != 0)
+		slot = (slot + 1) & mask;
+
+	strcpy(server->names[slot].name, name);
+	server->names[slot].conn = conn;
+}
+
+static void removeName(Server* server, int slot)
+{
+	uint32_t mask = server->nameMask;
+
+	// Shift the rest of the run back instead of leaving tombstones
+	server->names[slot].conn = 0;
+	for (uint32_t hole = slot, next = (slot + 1) & mask; server->names[next].conn != 0; next = (next + 1) & mask) {
+		uint32_t home = hashName(server->names[next].name) & mask;
+		bool stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+		if (stays)
+			continue;
+
+		server->names[hole] = server->names[next];
+		server->names[next].conn = 0;
+		hole = next;
+	}
+}
+
+static void updateEvents(Server* server, int i)
+{
+	Connection* conn = &server->conns[i];
+
+	// Only wait for POLLOUT while something is stuck
+	bool backlogged = conn->outHead || conn->bulkLeft > 0;
+	short events = POLLIN;
+	if (backlogged)
+		events |= POLLOUT;
+	server->fds[i].events = events;
+
+	if (conn->backlogged != backlogged)
+		server->backlogged += backlogged ? 1 : -1;
+	conn->backlogged = backlogged;
+}
+
+static void captureEvent(Server* server, int i, CaptureKind kind, const char* data, uint32_t len) // Inbound traffic, for the replay tool
+{
+	if (!server->capture)
+		return;
+
+	uint64_t now_us = monotonicUs();
+	uint64_t delay = now_us - server->capturedAt;
+	server->capturedAt = now_us;
+
+	char head[CAPTURE_RECORD_LEN];
+	CaptureRecord record = {
+		.kind = kind,
+		.conn = server->conns[i].captureId,
+		.delayUs = delay > UINT32_MAX ? UINT32_MAX : delay,
+		.len = len,
+	};
+	packRecord(head, &record);
+	server->captureDirty = true;
+
+	if (fwrite(head, sizeof(head), 1, server->capture) != 1 || (len > 0 && fwrite(data, len, 1, server->capture) != 1)) {
+		printError("Couldn't write the capture, recording stopped => errno:%s\n", strerror(errno));
+		fclose(server->capture);
+		server->capture = NULL;
+	}
+}
+
+static void sendToAll(Server* server, int sender, Frame* frame);
+static bool queueGap(Server* server, int i);
+
+static void closeConnection(Server* server, int i)
+{
+	Connection* conn = &server->conns[i];
+	int fd = server->fds[i].fd;
+
+	captureEvent(server, i, CAPTURE_CLOSE, NULL, 0);
+
+	// Nobody is going to finish these
+	server->fds[i].fd = -1;
+	for (int u = 0; u < MAX_UPLOADS; u++) {
+		if (conn->uploads[u].id == 0)
+			continue;
+
+		Frame* frame = newFrame(FRAME_FILE_ABORT, 0, conn->uploads[u].id, NULL, 0);
+		if (frame) {
+			sendToAll(server, i, frame);
+			releaseFrame(frame);
+		}
+	}
+	if (conn->activeUploads > 0)
+		releaseBulkPipes(server);
+
+	while (conn->outHead) {
+		Output* out = conn->outHead;
+		conn->outHead = out->next;
+		releaseFrame(out->frame);
+		poolFree(out, sizeof(Output));
+	}
+	poolFree(conn->in, FRAME_HEADER_LEN + MAX_BUFFER_SIZE);
+	closePipe(conn->stage);
+	closePipe(conn->bulk);
+	if (conn->ready) {
+		removeName(server, findName(server, conn->name));
+		server->sessions[conn->session & server->nameMask] = (SessionSlot){ conn->session, conn->lastClientSeq };
+	}
+	if (conn->backlogged)
+		server->backlogged--;
+	initConnection(conn);
+
+	close(fd);
+	server->compress_array = true;
+}
+
+static bool flushConnection(Server* server, int i) // Return false if the connection broke
+{
+	Connection* conn = &server->conns[i];
+	int fd = server->fds[i].fd;
+
+	while (true) {
+		// Text goes first, unless a chunk is already halfway out
+		if (conn->bulkLeft > 0 && (conn->bulkStarted || !conn->outHead)) {
+			ssize_t snd = splice(conn->bulk[0], NULL, fd, NULL, conn->bulkLeft, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (snd == -1) {
+				if (errno == EWOULDBLOCK || errno == EINTR)
+					break;
+				printWarning("splice error on %d: %s\n", fd, strerror(errno));
+				return false;
+			}
+
+			conn->bulkLeft -= snd;
+			conn->bulkStarted = conn->bulkLeft > 0;
+			if (conn->bulkLeft == 0 && conn->bulkLast)
+				closePipe(conn->bulk);
+			continue;
+		}
+
+		if (!conn->outHead) {
+			// Drained, so whatever was dropped meanwhile gets reported without waiting for the next message
+			if (conn->gapFrom == 0)
+				break;
+			if (!queueGap(server, i))
+				return false;
+			continue;
+		}
 
-	int bufferlen = strlen(send_buffer);
+		Frame* frame = conn->outHead->frame;
+		int snd = send(fd, frame->data + conn->outOffset, frame->len - conn->outOffset, MSG_NOSIGNAL);
+		if (snd == -1) {
+			if (errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			printWarning("send error on %d: %s\n", fd, strerror(errno));
+			return false;
+		}
+
+		conn->outOffset += snd;
+		conn->outBytes -= snd;
+		if (conn->outOffset < frame->len)
+			break;
+
+		Output* out = conn->outHead;
+		conn->outHead = out->next;
+		if (!conn->outHead)
+			conn->outTail = NULL;
+		conn->outOffset = 0;
+		releaseFrame(out->frame);
+		poolFree(out, sizeof(Output));
+	}
+
+	updateEvents(server, i);
+	return true;
+}
+
+static uint64_t frameSeq(const Frame* frame)
+{
+	FrameHeader header;
+	unpackHeader(frame->data, &header);
+	return header.seq;
+}
+
+static bool isDroppable(const Frame* frame) // Relayed messages are numbered, the client notices what it missed
+{
+	return frame->data[0] == FRAME_MSG;
+}
 
-	for (int i = 0; i < nfds; i++) {
-		if (fds[i].fd == server_socket) {
+static void dropOldest(Server* server, Connection* conn, size_t need) // Frees up to need bytes of queued messages
+{
+	Output* prev = NULL;
+	Output** link = &conn->outHead;
+	if (conn->outOffset > 0) { // Halfway out, it has to finish
+		prev = conn->outHead;
+		link = &prev->next;
+	}
+
+	// A run of dropped messages leaves a FRAME_GAP where it started, so the client hears
+	// about it in order. Anything else in between ends the run, an ack may carry a seq in it
+	Output* gap = NULL;
+	for (size_t freed = 0; *link && freed < need;) {
+		Output* out = *link;
+		if (!isDroppable(out->frame)) {
+			gap = out->frame->data[0] == FRAME_GAP ? out : NULL; // Left by an earlier call, it can grow
+			prev = out;
+			link = &out->next;
 			continue;
 		}
 
-		if (fds[i].fd == client_socket) {
+		uint64_t seq = frameSeq(out->frame);
+		freed += out->frame->len;
+		conn->outBytes -= out->frame->len;
+		conn->dropped++;
+		server->lagDropped++;
+
+		if (gap) { // Stretch it over this one too
+			FrameHeader header = { .type = FRAME_GAP, .seq = frameSeq(gap->frame), .aux = seq };
+			packHeader(gap->frame->data, &header);
+		} else {
+			Frame* frame = newFrame(FRAME_GAP, seq, seq, NULL, 0);
+			if (frame) { // The node stays and carries the gap instead
+				releaseFrame(out->frame);
+				out->frame = frame;
+				conn->outBytes += frame->len;
+				freed -= frame->len;
+				gap = prev = out;
+				link = &out->next;
+				continue;
+			}
+		}
+
+		*link = out->next;
+		if (conn->outTail == out)
+			conn->outTail = prev;
+		releaseFrame(out->frame);
+		poolFree(out, sizeof(Output));
+	}
+}
+
+static bool appendOutput(Server* server, int i, Frame* frame)
+{
+	Connection* conn = &server->conns[i];
+
+	Output* out = poolAlloc(sizeof(Output));
+	if (!out) {
+		printWarning("Out of buffer memory, dropping %d\n", server->fds[i].fd);
+		return false;
+	}
+
+	frame->refs++;
+	out->frame = frame;
+	out->queuedAt = server->now;
+	out->next = NULL;
+
+	if (conn->outTail)
+		conn->outTail->next = out;
+	else
+		conn->outHead = out;
+	conn->outTail = out;
+	conn->outBytes += frame->len;
+	if (conn->outBytes > conn->peakBytes)
+		conn->peakBytes = conn->outBytes;
+	return true;
+}
+
+static bool queueGap(Server* server, int i) // Owe the client a FRAME_GAP? Return false if the connection broke
+{
+	Connection* conn = &server->conns[i];
+	if (conn->gapFrom == 0)
+		return true;
+
+	Frame* gap = newFrame(FRAME_GAP, conn->gapFrom, conn->gapTo, NULL, 0);
+	bool ok = gap && appendOutput(server, i, gap);
+	releaseFrame(gap);
+	if (ok)
+		conn->gapFrom = conn->gapTo = 0;
+	return ok;
+}
+
+static bool queueFrame(Server* server, int i, Frame* frame) // Return false if the connection broke
+{
+	Connection* conn = &server->conns[i];
+	bool droppable = isDroppable(frame);
+	size_t limit = server->lagBytes;
+
+	if (droppable && server->lagPolicy == LAG_DROP_OLDEST && conn->outBytes + frame->len > limit)
+		dropOldest(server, conn, conn->outBytes + frame->len - limit);
+
+	// Only messages may be dropped, everything else gets twice the room before we give up
+	if (conn->outBytes + frame->len > limit) {
+		if (droppable && server->lagPolicy != LAG_DISCONNECT) {
+			uint64_t seq = frameSeq(frame);
+			if (conn->gapFrom == 0)
+				conn->gapFrom = seq;
+			conn->gapTo = seq;
+			conn->dropped++;
+			server->lagDropped++;
+			return true;
+		}
+
+		if (server->lagPolicy == LAG_DISCONNECT || conn->outBytes + frame->len > 2 * limit) {
+			printWarning("Connection %d is %zu bytes behind, dropping it\n", server->fds[i].fd, conn->outBytes);
+			server->lagDisconnects++;
+			return false;
+		}
+	}
+
+	bool was_idle = conn->outHead == NULL;
+	if (!queueGap(server, i)) // Room again, say what was lost before an ack or message moves past it
+		return false;
+
+	if (!appendOutput(server, i, frame))
+		return false;
+
+	// Nothing ahead of it, so try to hand it to the kernel right away
+	return was_idle ? flushConnection(server, i) : true;
+}
+
+static bool sendFrame(Server* server, int i, uint8_t type, uint64_t seq, uint64_t aux, const char* payload, uint32_t len)
+{
+	Frame* frame = newFrame(type, seq, aux, payload, len);
+	if (!frame)
+		return false;
+
+	bool ok = queueFrame(server, i, frame);
+	releaseFrame(frame);
+	return ok;
+}
+
+static void tuneSocket(Server* server, int fd) // Every client socket goes through here
+{
+	if (server->busyCpu < 0)
+		return;
+
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	// Best effort, going past net.core.busy_read needs CAP_NET_ADMIN
+	int busy_us = BUSY_POLL_US;
+	setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_us, sizeof(busy_us));
+}
+
+static bool isReceiver(Server* server, int sender, int i)
+{
+	return i != sender && server->fds[i].fd != -1 && server->fds[i].fd != server->server_socket && server->conns[i].ready;
+}
+
+static bool publish(Server* server, uint64_t origin, const char* frame, uint32_t len) // One datagram for the whole group
+{
+	uint64_t be_origin = htobe64(origin);
+	struct iovec iov[2] = {
+		{ .iov_base = &be_origin, .iov_len = sizeof(be_origin) },
+		{ .iov_base = (void*)frame, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_name = &server->mcastAddr,
+		.msg_namelen = sizeof(server->mcastAddr),
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	server->publishedAt = server->now;
+	if (sendmsg(server->mcast_socket, &msg, MSG_DONTWAIT) == -1) {
+		server->publishFailed++;
+		return false;
+	}
+	server->published++;
+	return true;
+}
+
+static void publishHeartbeat(Server* server)
+{
+	char frame[FRAME_HEADER_LEN];
+	FrameHeader header = { .type = FRAME_MULTICAST, .seq = server->seq };
+	packHeader(frame, &header);
+	publish(server, 0, frame, sizeof(frame));
+}
+
+static void sendToAll(Server* server, int sender, Frame* frame)
+{
+	TRACE_BEGIN(sendToAll);
+
+	// Relayed messages go out once on the group, if that fails everybody gets them over TCP
+	bool published = server->mcast_socket != -1 && frame->data[0] == FRAME_MSG
+		&& publish(server, server->conns[sender].origin, frame->data, frame->len);
+
+	for (int i = 0; i < server->nfds; i++) {
+		if (!isReceiver(server, sender, i) || (published && server->conns[i].multicast)) {
 			continue;
 		}
 
-		if (send(fds[i].fd, send_buffer, bufferlen, 0) == -1)
-			printError("send error: %s\n", strerror(errno));
+		if (!queueFrame(server, i, frame))
+			closeConnection(server, i);
 	}
+
+	TRACE_END(sendToAll, server->nfds);
 }
 
-static bool acceptConnection(char* send_buffer, int server_socket, struct pollfd* fds, int* nfds) // Return false if exit condition else true
+static bool acceptConnection(Server* server) // Return false if exit condition else true
 {
 	int new_socket;
 	do {
-		new_socket = accept(server_socket, NULL, NULL);
+		new_socket = accept(server->server_socket, NULL, NULL);
 		if (new_socket < 0) {
 			if (errno != EWOULDBLOCK) {
 				return false;
@@ -216,21 +1014,16 @@ static bool acceptConnection(char* send_buffer, int server_socket, struct pollfd
 			break;
 		}
 
-		if (*nfds > MAX_CLIENTS) { // Server is full
-			sendMsg(send_buffer, new_socket, SERVER_FULL_STRING);
+		if (server->nfds - server->listeners >= server->max_clients) { // Server is full
+			char full[FRAME_HEADER_LEN];
+			FrameHeader header = { .type = FRAME_FULL };
+			packHeader(full, &header);
+			send(new_socket, full, sizeof(full), MSG_NOSIGNAL | MSG_DONTWAIT);
 			close(new_socket);
 			printError("Server is full!\n");
 			return true;
 		}
 
-		char name[MAX_NAME_LEN + 1] = { 0 };
-		int rc = recv(new_socket, name, MAX_NAME_LEN, 0);
-		if (rc == -1) {
-			close(new_socket);
-			return false;
-		}
-		name[rc] = '\0';
-
 		int flags = fcntl(new_socket, F_GETFL, 0);
 		if (flags == -1) {
 			printError("Coudnl't retrive flags for %d with fcntl()! => errno:%s\n", new_socket, strerror(errno));
@@ -244,126 +1037,1681 @@ static bool acceptConnection(char* send_buffer, int server_socket, struct pollfd
 			return true;
 		}
 
-		printMsg("New connection on socket %d with name %s\n", new_socket, name);
+		tuneSocket(server, new_socket);
 
-		fds[*nfds].fd = new_socket;
-		fds[*nfds].events = POLLIN;
-		*nfds += 1;
+		// The name arrives with the HELLO frame
+		server->fds[server->nfds].fd = new_socket;
+		server->fds[server->nfds].events = POLLIN;
+		server->fds[server->nfds].revents = 0;
+		initConnection(&server->conns[server->nfds]);
+		server->conns[server->nfds].captureId = ++server->nextCaptureId;
+		captureEvent(server, server->nfds, CAPTURE_CONNECT, NULL, 0);
+		server->nfds += 1;
 	} while (new_socket != -1);
 
 	return true;
 }
 
-static bool handleConnection(char* send_buffer, char* recv_buffer, int client_socket, int server_socket, struct pollfd* fds, int nfds)
+static uint64_t lastAcceptedSeq(Server* server, uint64_t session) // Newest client seq of the session we still know of
 {
-	int rc = 0;
-	int len = 0;
-
-	do {
-		rc = recv(client_socket, recv_buffer, MAX_BUFFER_SIZE, 0);
-		if (rc < 0) {
-			if (errno != EWOULDBLOCK) {
-				printWarning("Connection %d closed => errno: %s\n", client_socket, strerror(errno));
-				return false;
-			}
-			break;
-		}
-
-		if (rc == 0) {
-			printWarning("Connection %d closed\n", client_socket);
-			return false; // connection closed
-		}
-
-		len = rc;
-	} while (true);
+	// Direct messages and who requests only show up in the slot, a collision or a
+	// handoff loses it and messages still in the history have to do
+	SessionSlot* slot = &server->sessions[session & server->nameMask];
+	uint64_t last = slot->session == session ? slot->clientSeq : 0;
+
+	for (uint64_t seq = server->seq; seq > 0 && seq + HISTORY_SIZE > server->seq; seq--) {
+		HistoryEntry* entry = &server->history[seq % HISTORY_SIZE];
+		if (entry->seq == seq && entry->session == session)
+			return entry->clientSeq > last ? entry->clientSeq : last;
+	}
+	return last;
+}
 
-	if (len >= MAX_BUFFER_SIZE) len = MAX_BUFFER_SIZE - 1;
+static bool replayHistory(Server* server, int i, uint64_t from, uint64_t to) // Whatever of from..to is still kept
+{
+	Connection* conn = &server->conns[i];
 
-	recv_buffer[len] = '\0';
+	if (server->seq >= HISTORY_SIZE && from <= server->seq - HISTORY_SIZE)
+		from = server->seq - HISTORY_SIZE + 1;
+	if (to > server->seq)
+		to = server->seq;
 
-	sendToAll(send_buffer, client_socket, server_socket, fds, nfds, recv_buffer);
+	for (uint64_t seq = from; seq <= to; seq++) {
+		HistoryEntry* entry = &server->history[seq % HISTORY_SIZE];
+		if (entry->seq != seq) // Never got handed over
+			continue;
+		bool ok = entry->session == conn->session
+			? sendFrame(server, i, FRAME_ACK, entry->clientSeq, entry->seq, NULL, 0)
+			: queueFrame(server, i, entry->frame);
+		if (!ok)
+			return false;
+	}
 
 	return true;
 }
 
-int main(int argc, char** argv)
+static bool handleHello(Server* server, int i, const FrameHeader* header, const char* payload)
 {
-	Result result = SUCCESS;
+	Connection* conn = &server->conns[i];
 
-	int server_socket = 0;
-	result = initServer(&server_socket);
-	CHECK_RESULT(result);
+	if (conn->ready || (header->flags & ~HELLO_RESUME) != PROTOCOL_VERSION) {
+		printWarning("Bad hello on %d\n", server->fds[i].fd);
+		return false;
+	}
 
-	bool end_server = false, compress_array = false;
-	const int timeout = (6 * 60 * 1000); // 6 min
-	int    nfds = 1, current_size = 0;
-	struct pollfd fds[MAX_CLIENTS + 1] = { 0 }; // +1 for server
-	fds[0].fd = server_socket;
-	fds[0].events = POLLIN;
+	uint32_t len = sanitizeText(conn->name, MAX_NAME_LEN, payload, header->len, false);
+	conn->name[len] = '\0';
+	if (len == 0 || strchr(conn->name, '\n')) {
+		printWarning("Bad name on %d\n", server->fds[i].fd);
+		return false;
+	}
 
-	char send_buffer[MAX_BUFFER_SIZE] = { 0 };
-	char recv_buffer[MAX_BUFFER_SIZE] = { 0 };
+	int slot = findName(server, conn->name);
+	if (slot != -1) {
+		int other = server->names[slot].conn;
+		if (server->conns[other].session != header->aux) {
+			printWarning("Name %s is taken, rejecting %d\n", conn->name, server->fds[i].fd);
+			sendFrame(server, i, FRAME_NAME_TAKEN, 0, 0, NULL, 0);
+			return false;
+		}
 
-	do {
-		int rc = poll(fds, nfds, timeout);
+		// Same client on a new connection, the old one is dead but we haven't noticed yet
+		printWarning("Connection %d replaced by %d\n", server->fds[other].fd, server->fds[i].fd);
+		closeConnection(server, other);
+	}
 
-		if (rc < 0)
-		{
-			result = ERROR_POLL_FAIL;
-			break;
-		}
+	addName(server, conn->name, i);
+	conn->session = header->aux;
+	conn->lastClientSeq = lastAcceptedSeq(server, conn->session);
+	conn->ready = true;
 
-		if (rc == 0)
-		{
-			result = ERROR_POLL_TIMEOUT;
-			break;
-		}
+	printMsg("New connection on socket %d with name %s\n", server->fds[i].fd, conn->name);
 
-		current_size = nfds;
-		for (int i = 0; i < current_size; i++) {
-			if(fds[i].revents == 0)
+	if (!sendFrame(server, i, FRAME_WELCOME, server->seq, conn->lastClientSeq, NULL, 0))
+		return false;
+
+	if (server->mcast_socket != -1) {
+		conn->origin = ++server->nextOrigin;
+		if (!sendFrame(server, i, FRAME_MULTICAST, conn->origin, 0, server->mcastGroup, strlen(server->mcastGroup)))
+			return false;
+	}
+
+	// Delta since the last message the client saw, a seq from the future means we restarted
+	if (!(header->flags & HELLO_RESUME) || header->seq >= server->seq)
+		return true;
+
+	return replayHistory(server, i, header->seq + 1, server->seq);
+}
+
+static bool handleMessage(Server* server, int i, const FrameHeader* header, const char* payload)
+{
+	Connection* conn = &server->conns[i];
+	uint64_t received_us = wallClockUs();
+
+	if (!conn->ready)
+		return false;
+
+	if (header->seq <= conn->lastClientSeq) // Resent after a reconnect, we already have it
+		return sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+
+	// Once per message, every receiver gets the same clean frame
+	uint32_t len = sanitizeText(server->clean_buffer, MAX_BUFFER_SIZE, payload, header->len, true);
+	if (len == 0) { // Nothing left worth relaying
+		conn->lastClientSeq = header->seq;
+		return sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+	}
+
+	Frame* frame = newFrame(FRAME_MSG, server->seq + 1, received_us, server->clean_buffer, len);
+	if (!frame)
+		return false;
+
+	server->seq++;
+	conn->lastClientSeq = header->seq;
+
+	HistoryEntry* entry = &server->history[server->seq % HISTORY_SIZE];
+	releaseFrame(entry->frame);
+	entry->seq = server->seq;
+	entry->session = conn->session;
+	entry->clientSeq = header->seq;
+	entry->frame = frame; // The history keeps our reference
+
+	if (!sendFrame(server, i, FRAME_ACK, header->seq, server->seq, NULL, 0))
+		return false;
+
+	sendToAll(server, i, frame);
+	return true;
+}
+
+// Direct messages go to one connection only and aren't numbered or kept in the
+// history, so everybody else's seq stays gapless.
+static bool handleDirect(Server* server, int i, const FrameHeader* header, const char* payload)
+{
+	Connection* conn = &server->conns[i];
+
+	uint64_t received_us = wallClockUs();
+	const char* text = memchr(payload, '\0', header->len);
+	if (!conn->ready || !text || text == payload || text - payload > MAX_NAME_LEN)
+		return false;
+	text++;
+
+	if (header->seq <= conn->lastClientSeq)
+		return sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+	conn->lastClientSeq = header->seq;
+
+	int slot = findName(server, payload);
+	if (slot == -1) {
+		char notice[3 * MAX_NAME_LEN + 32]; // Room for every byte of the name to turn into U+FFFD
+		uint32_t name_len = sanitizeText(notice, sizeof(notice) - 32, payload, text - 1 - payload, false);
+		int notice_len = name_len + snprintf(notice + name_len, sizeof(notice) - name_len, " is not online");
+		return sendFrame(server, i, FRAME_NOTICE, 0, 0, notice, notice_len)
+			&& sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+	}
+
+	// Sender name, then the clean text
+	uint32_t name_len = strlen(conn->name) + 1;
+	memcpy(server->clean_buffer, conn->name, name_len);
+	uint32_t len = sanitizeText(server->clean_buffer + name_len, MAX_BUFFER_SIZE - name_len,
+				    text, header->len - (text - payload), true);
+	if (len == 0)
+		return sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+
+	int target = server->names[slot].conn;
+	if (!sendFrame(server, target, FRAME_DIRECT, 0, received_us, server->clean_buffer, name_len + len)) {
+		if (target == i)
+			return false;
+		closeConnection(server, target);
+	}
+
+	return server->fds[i].fd == -1 || sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+}
+
+static bool handleWho(Server* server, int i, const FrameHeader* header)
+{
+	Connection* conn = &server->conns[i];
+
+	if (!conn->ready)
+		return false;
+
+	if (header->seq <= conn->lastClientSeq) // Answered before the reconnect
+		return sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+	conn->lastClientSeq = header->seq;
+
+	// As many names as fit, seq carries the real count
+	uint64_t online = 0;
+	uint32_t len = 0;
+	for (int c = server->listeners; c < server->nfds; c++) {
+		if (server->fds[c].fd == -1 || !server->conns[c].ready)
+			continue;
+
+		online++;
+		uint32_t name_len = strlen(server->conns[c].name);
+		if (len + name_len + 1 > MAX_BUFFER_SIZE)
+			continue;
+		if (len > 0)
+			server->clean_buffer[len++] = '\n';
+		memcpy(server->clean_buffer + len, server->conns[c].name, name_len);
+		len += name_len;
+	}
+
+	return sendFrame(server, i, FRAME_WHO, online, 0, server->clean_buffer, len)
+		&& sendFrame(server, i, FRAME_ACK, header->seq, 0, NULL, 0);
+}
+
+static bool handleJoin(Server* server, int i, const FrameHeader* header) // The client listens on the group now, or gave up on it
+{
+	Connection* conn = &server->conns[i];
+
+	if (!conn->ready)
+		return false;
+
+	if (header->flags & MULTICAST_LEAVE) {
+		if (!conn->multicast)
+			return true;
+		conn->multicast = false;
+		return replayHistory(server, i, header->seq + 1, server->seq);
+	}
+
+	if (server->mcast_socket == -1)
+		return false;
+
+	conn->multicast = true;
+	return true;
+}
+
+static bool handleResend(Server* server, int i, const FrameHeader* header) // Fills in datagrams that got lost
+{
+	if (!server->conns[i].ready || header->seq == 0 || header->seq > header->aux)
+		return false;
+
+	return replayHistory(server, i, header->seq, header->aux);
+}
+
+static bool isCut(Connection* receiver, uint64_t transfer)
+{
+	for (int c = 0; c < MAX_CUT_TRANSFERS; c++) {
+		if (receiver->cut[c] == transfer)
+			return true;
+	}
+	return false;
+}
+
+static void markCut(Connection* receiver, uint64_t transfer) // Its chunks skip the receiver from now on
+{
+	receiver->cut[receiver->cutNext++ % MAX_CUT_TRANSFERS] = transfer;
+}
+
+static bool cutTransfer(Server* server, int r, uint64_t transfer) // The receiver misses the file but stays
+{
+	Connection* receiver = &server->conns[r];
+	markCut(receiver, transfer);
+	releaseBulkPipe(receiver);
+
+	Frame* frame = newFrame(FRAME_FILE_ABORT, 0, transfer, NULL, 0);
+	if (!frame)
+		return false;
+	frame->data[1] = FILE_ABORT_BEHIND;
+	bool ok = queueFrame(server, r, frame);
+	releaseFrame(frame);
+	return ok;
+}
+
+static Upload* findUpload(Connection* conn, uint64_t client_id)
+{
+	for (int u = 0; u < MAX_UPLOADS; u++) {
+		if (conn->uploads[u].id != 0 && conn->uploads[u].clientId == client_id)
+			return &conn->uploads[u];
+	}
+	return NULL;
+}
+
+static void finishUpload(Connection* conn, Upload* upload)
+{
+	upload->id = 0;
+	if (--conn->activeUploads == 0)
+		closePipe(conn->stage);
+}
+
+static bool handleFileBegin(Server* server, int i, const FrameHeader* header, const char* payload)
+{
+	Connection* conn = &server->conns[i];
+	Upload* upload = NULL;
+
+	if (!conn->ready || findUpload(conn, header->aux))
+		return false;
+
+	for (int u = 0; u < MAX_UPLOADS && !upload; u++) {
+		if (conn->uploads[u].id == 0)
+			upload = &conn->uploads[u];
+	}
+
+	if (!upload || (header->seq > 0 && !openPipe(conn->stage))) { // Turn it down, the connection itself is fine
+		Frame* frame = newFrame(FRAME_FILE_ABORT, 0, header->aux, NULL, 0);
+		if (!frame)
+			return false;
+		frame->data[1] = FILE_ABORT_OWN;
+		bool ok = queueFrame(server, i, frame);
+		releaseFrame(frame);
+		return ok;
+	}
+
+	char relay[MAX_BUFFER_SIZE];
+	uint32_t name_len = strlen(conn->name) + 1;
+	memcpy(relay, conn->name, name_len);
+	// The relayed payload has to stay a non-chunk one, so the name gets what's left
+	uint32_t file_len = sanitizeText(relay + name_len, MAX_BUFFER_SIZE - name_len, payload, header->len, false);
+
+	Frame* frame = newFrame(FRAME_FILE_BEGIN, header->seq, ++server->nextTransfer, relay, name_len + file_len);
+	if (!frame)
+		return false;
+
+	printMsg("%s is sending %.*s (%llu bytes)\n", conn->name, (int)file_len, relay + name_len, (unsigned long long)header->seq);
+
+	if (header->seq > 0) {
+		upload->id = server->nextTransfer;
+		upload->clientId = header->aux;
+		upload->size = header->seq;
+		upload->received = 0;
+		conn->activeUploads++;
+	}
+
+	sendToAll(server, i, frame);
+	releaseFrame(frame);
+	return true;
+}
+
+static bool handleFileAbort(Server* server, int i, const FrameHeader* header)
+{
+	Connection* conn = &server->conns[i];
+
+	if (header->flags & FILE_ABORT_DECLINE) { // Not its upload, a download it turned down
+		if (!conn->ready)
+			return false;
+		markCut(conn, header->aux);
+		return true;
+	}
+
+	Upload* upload = findUpload(conn, header->aux);
+	if (!upload)
+		return true; // Already over
+
+	Frame* frame = newFrame(FRAME_FILE_ABORT, 0, upload->id, NULL, 0);
+	finishUpload(conn, upload);
+	releaseBulkPipes(server);
+	if (!frame)
+		return false;
+
+	sendToAll(server, i, frame);
+	releaseFrame(frame);
+	return true;
+}
+
+static bool startChunk(Server* server, int i, const FrameHeader* header)
+{
+	Connection* conn = &server->conns[i];
+	Upload* upload = findUpload(conn, header->aux);
+
+	char head[FRAME_HEADER_LEN]; // The payload never comes up here
+	packHeader(head, header);
+	captureEvent(server, i, CAPTURE_FRAME, head, sizeof(head));
+
+	if (!upload || header->len == 0 || header->seq != upload->received || header->len > upload->size - upload->received) {
+		printWarning("Bad file chunk on %d\n", server->fds[i].fd);
+		return false;
+	}
+
+	conn->chunk = *header;
+	conn->chunkUpload = upload - conn->uploads;
+	conn->chunkHave = 0;
+	conn->chunkPending = true;
+	return true;
+}
+
+// Hands the staged chunk to every receiver. One still busy with an earlier chunk is dropped from
+// the transfer rather than holding up the sender and everybody else.
+static bool relayChunk(Server* server, int i) // Return false if the sender broke
+{
+	Connection* conn = &server->conns[i];
+
+	FrameHeader header = {
+		.type = FRAME_FILE_CHUNK,
+		.len = conn->chunk.len,
+		.seq = conn->chunk.seq,
+		.aux = conn->uploads[conn->chunkUpload].id,
+	};
+	char packed[FRAME_HEADER_LEN];
+	packHeader(packed, &header);
+	Upload* upload = &conn->uploads[conn->chunkUpload];
+	bool last = upload->received + header.len == upload->size;
+
+	for (int r = 0; r < server->nfds; r++) {
+		if (!isReceiver(server, i, r))
+			continue;
+
+		Connection* receiver = &server->conns[r];
+		if (isCut(receiver, header.aux))
+			continue;
+		if (receiver->bulkLeft > 0 || !openPipe(receiver->bulk)) { // Fell behind, or out of pipe pages
+			if (!cutTransfer(server, r, header.aux))
+				closeConnection(server, r);
+			continue;
+		}
+
+		// tee() only takes page references, the payload is never copied
+		if (write(receiver->bulk[1], packed, FRAME_HEADER_LEN) != FRAME_HEADER_LEN ||
+		    tee(conn->stage[0], receiver->bulk[1], header.len, SPLICE_F_NONBLOCK) != header.len) {
+			printWarning("Couldn't pass a chunk to %d, dropping it\n", server->fds[r].fd);
+			closeConnection(server, r);
+			continue;
+		}
+
+		receiver->bulkLeft = FRAME_HEADER_LEN + header.len;
+		receiver->bulkLast = last;
+		receiver->bulkSince = server->now;
+		if (!flushConnection(server, r))
+			closeConnection(server, r);
+	}
+
+	if (server->fds[i].fd == -1) // Dropped along with a receiver
+		return true;
+
+	for (uint32_t left = header.len; left > 0;) {
+		ssize_t moved = splice(conn->stage[0], NULL, server->devnull, NULL, left, SPLICE_F_MOVE);
+		if (moved <= 0) {
+			printError("Couldn't drain the stage pipe of %d => errno:%s\n", server->fds[i].fd, strerror(errno));
+			return false;
+		}
+		left -= moved;
+	}
+
+	upload->received += header.len;
+	if (last)
+		finishUpload(conn, upload);
+	conn->chunkPending = false;
+	return true;
+}
+
+static bool handleFrame(Server* server, int i, const char* data)
+{
+	FrameHeader header;
+	unpackHeader(data, &header);
+	const char* payload = data + FRAME_HEADER_LEN;
+	captureEvent(server, i, CAPTURE_FRAME, data, FRAME_HEADER_LEN + header.len);
+
+	switch (header.type) {
+	case FRAME_HELLO:
+		return handleHello(server, i, &header, payload);
+
+	case FRAME_MSG:
+		return handleMessage(server, i, &header, payload);
+
+	case FRAME_DIRECT:
+		return handleDirect(server, i, &header, payload);
+
+	case FRAME_WHO:
+		return handleWho(server, i, &header);
+
+	case FRAME_MULTICAST:
+		return handleJoin(server, i, &header);
+
+	case FRAME_RESEND:
+		return handleResend(server, i, &header);
+
+	case FRAME_FILE_BEGIN:
+		return handleFileBegin(server, i, &header, payload);
+
+	case FRAME_FILE_ABORT:
+		return handleFileAbort(server, i, &header);
+
+	default:
+		printWarning("Unknown frame type %d on %d\n", header.type, server->fds[i].fd);
+		return false;
+	}
+}
+
+static bool consumeBytes(Server* server, int i, const char* data, size_t len) // Split the stream into frames
+{
+	Connection* conn = &server->conns[i];
+
+	while (len > 0) {
+		FrameHeader header;
+
+		if (server->fds[i].fd == -1) // Dropped while fanning out
+			return true;
+
+		// Chunk payload that came in with a plain recv
+		if (conn->chunkPending) {
+			size_t take = conn->chunk.len - conn->chunkHave < len ? conn->chunk.len - conn->chunkHave : len;
+			if (write(conn->stage[1], data, take) != (ssize_t)take)
+				return false;
+			conn->chunkHave += take;
+			data += take;
+			len -= take;
+
+			if (conn->chunkHave == conn->chunk.len && !relayChunk(server, i))
+				return false;
+			continue;
+		}
+
+		// Whole frames straight out of the recv buffer
+		if (conn->inLen == 0 && len >= FRAME_HEADER_LEN) {
+			unpackHeader(data, &header);
+			if (!checkFrameLength(&header))
+				return false;
+
+			if (header.type == FRAME_FILE_CHUNK) {
+				if (!startChunk(server, i, &header))
+					return false;
+				data += FRAME_HEADER_LEN;
+				len -= FRAME_HEADER_LEN;
 				continue;
+			}
 
-			if(fds[i].revents != POLLIN)
-			{
-				result = ERROR_POLL_REVENTS;
-				end_server = true;
-				break;
+			size_t frame_len = FRAME_HEADER_LEN + header.len;
+			if (len >= frame_len) {
+				if (!handleFrame(server, i, data))
+					return false;
+				data += frame_len;
+				len -= frame_len;
+				continue;
+			}
+		}
+
+		// The rest waits for more bytes
+		if (!conn->in) {
+			conn->in = poolAlloc(FRAME_HEADER_LEN + MAX_BUFFER_SIZE);
+			if (!conn->in)
+				return false;
+		}
+
+		size_t want = FRAME_HEADER_LEN;
+		if (conn->inLen >= FRAME_HEADER_LEN) {
+			unpackHeader(conn->in, &header);
+			want += header.len;
+		}
+
+		size_t take = want - conn->inLen < len ? want - conn->inLen : len;
+		memcpy(conn->in + conn->inLen, data, take);
+		conn->inLen += take;
+		data += take;
+		len -= take;
+
+		if (conn->inLen == FRAME_HEADER_LEN) {
+			unpackHeader(conn->in, &header);
+			if (!checkFrameLength(&header))
+				return false;
+
+			if (header.type == FRAME_FILE_CHUNK) {
+				poolFree(conn->in, FRAME_HEADER_LEN + MAX_BUFFER_SIZE);
+				conn->in = NULL;
+				conn->inLen = 0;
+				if (!startChunk(server, i, &header))
+					return false;
+				continue;
+			}
+		}
+
+		if (conn->inLen >= FRAME_HEADER_LEN) {
+			unpackHeader(conn->in, &header);
+			if (conn->inLen == FRAME_HEADER_LEN + header.len) {
+				bool ok = handleFrame(server, i, conn->in);
+				poolFree(conn->in, FRAME_HEADER_LEN + MAX_BUFFER_SIZE);
+				conn->in = NULL;
+				conn->inLen = 0;
+				if (!ok)
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static size_t nextReadSize(Connection* conn) // While uploading, stop at frame boundaries so chunks stay in the socket for splice()
+{
+	if (conn->activeUploads == 0)
+		return RECV_BUFFER_SIZE;
+
+	if (conn->inLen < FRAME_HEADER_LEN)
+		return FRAME_HEADER_LEN - conn->inLen;
+
+	FrameHeader header;
+	unpackHeader(conn->in, &header);
+	return FRAME_HEADER_LEN + header.len - conn->inLen;
+}
+
+static bool handleConnection(Server* server, int i)
+{
+	Connection* conn = &server->conns[i];
+	int client_socket = server->fds[i].fd;
+
+	for (int reads = 0; reads < MAX_READS_PER_WAKEUP; reads++) {
+		int rc;
+		if (conn->chunkPending)
+			rc = splice(client_socket, NULL, conn->stage[1], NULL, conn->chunk.len - conn->chunkHave,
+				    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			rc = recv(client_socket, server->recv_buffer, nextReadSize(conn), 0);
+
+		if (rc < 0) {
+			if (errno != EWOULDBLOCK) {
+				printWarning("Connection %d closed => errno: %s\n", client_socket, strerror(errno));
+				return false;
+			}
+			break;
+		}
+
+		if (rc == 0) {
+			printWarning("Connection %d closed\n", client_socket);
+			return false; // connection closed
+		}
+
+		if (conn->chunkPending) {
+			conn->chunkHave += rc;
+			if (conn->chunkHave == conn->chunk.len && !relayChunk(server, i))
+				return false;
+		} else if (!consumeBytes(server, i, server->recv_buffer, rc)) {
+			return false;
+		}
+
+		if (server->fds[i].fd == -1) // Dropped while fanning out
+			return true;
+	}
+
+	return true;
+}
+
+// Upgrades: a new server started with the same -u path connects to the old one, which
+// passes it the listening socket, every client socket (SCM_RIGHTS) and the state that
+// goes with them, then exits. Every record is packed field by field, big endian, behind
+// a versioned header, so the two ends only have to agree on HANDOFF_VERSION.
+//
+//	header:     u64 magic | u32 version | u64 seq | u64 next transfer | u64 next origin |
+//	            u32 history entries | u32 connections | group[MAX_GROUP_LEN + 1]
+//	entry:      u64 seq | u64 session | u64 client seq | u32 len, then the frame
+//	connection: name[MAX_NAME_LEN + 1] | u8 ready | u8 multicast | u64 session |
+//	            u64 last client seq | u64 gap from | u64 gap to | u64 dropped | u64 peak bytes |
+//	            u64 origin | u32 in len | u32 out offset | u32 out len, then the partial inbound
+//	            frame. The socket rides along and every queued frame follows in a packet of its own
+//
+// The old server packs it all up front and sends it from its poll loop. Clients sit out
+// until the new server answers or the handoff times out, so nothing moves under the snapshot.
+typedef struct {
+	uint64_t seq;
+	uint64_t nextTransfer;
+	uint64_t nextOrigin;
+	uint32_t history; // Entries that follow
+	uint32_t conns; // Connections after the history
+	char mcastGroup[MAX_GROUP_LEN + 1]; // Clients that joined it stay there if we publish to the same one
+} HandoffHeader;
+
+typedef struct {
+	uint64_t seq;
+	uint64_t session;
+	uint64_t clientSeq;
+	uint32_t len; // Frame bytes that follow
+} HandoffEntry;
+
+typedef struct {
+	char name[MAX_NAME_LEN + 1];
+	bool ready;
+	bool multicast;
+	uint64_t session;
+	uint64_t lastClientSeq;
+	uint64_t gapFrom, gapTo;
+	uint64_t dropped;
+	uint64_t peakBytes;
+	uint64_t origin;
+	uint32_t inLen; // Partial inbound frame that follows
+	uint32_t outOffset;
+	uint32_t outLen; // Queued frames after that, the first one outOffset bytes sent
+} HandoffConn;
+
+static char* put32(char* out, uint32_t value)
+{
+	value = htobe32(value);
+	memcpy(out, &value, sizeof(value));
+	return out + sizeof(value);
+}
+
+static char* put64(char* out, uint64_t value)
+{
+	value = htobe64(value);
+	memcpy(out, &value, sizeof(value));
+	return out + sizeof(value);
+}
+
+static const char* get32(const char* in, uint32_t* value)
+{
+	memcpy(value, in, sizeof(*value));
+	*value = be32toh(*value);
+	return in + sizeof(*value);
+}
+
+static const char* get64(const char* in, uint64_t* value)
+{
+	memcpy(value, in, sizeof(*value));
+	*value = be64toh(*value);
+	return in + sizeof(*value);
+}
+
+static void packHandoffHeader(char* out, const HandoffHeader* header)
+{
+	out = put64(out, HANDOFF_MAGIC);
+	out = put32(out, HANDOFF_VERSION);
+	out = put64(out, header->seq);
+	out = put64(out, header->nextTransfer);
+	out = put64(out, header->nextOrigin);
+	out = put32(out, header->history);
+	out = put32(out, header->conns);
+	memcpy(out, header->mcastGroup, sizeof(header->mcastGroup));
+}
+
+static bool unpackHandoffHeader(const char* in, HandoffHeader* header) // False unless it's our magic and version
+{
+	uint64_t magic;
+	uint32_t version;
+	in = get64(in, &magic);
+	in = get32(in, &version);
+	if (magic != HANDOFF_MAGIC || version != HANDOFF_VERSION) {
+		printError("The running server speaks another handoff version (%u, we need %u)\n", version, HANDOFF_VERSION);
+		return false;
+	}
+
+	in = get64(in, &header->seq);
+	in = get64(in, &header->nextTransfer);
+	in = get64(in, &header->nextOrigin);
+	in = get32(in, &header->history);
+	in = get32(in, &header->conns);
+	memcpy(header->mcastGroup, in, sizeof(header->mcastGroup));
+	header->mcastGroup[MAX_GROUP_LEN] = '\0';
+	return true;
+}
+
+static void packHandoffEntry(char* out, const HandoffEntry* entry)
+{
+	out = put64(out, entry->seq);
+	out = put64(out, entry->session);
+	out = put64(out, entry->clientSeq);
+	put32(out, entry->len);
+}
+
+static void unpackHandoffEntry(const char* in, HandoffEntry* entry)
+{
+	in = get64(in, &entry->seq);
+	in = get64(in, &entry->session);
+	in = get64(in, &entry->clientSeq);
+	get32(in, &entry->len);
+}
+
+static void packHandoffConn(char* out, const HandoffConn* conn)
+{
+	memcpy(out, conn->name, sizeof(conn->name));
+	out += sizeof(conn->name);
+	*out++ = conn->ready;
+	*out++ = conn->multicast;
+	out = put64(out, conn->session);
+	out = put64(out, conn->lastClientSeq);
+	out = put64(out, conn->gapFrom);
+	out = put64(out, conn->gapTo);
+	out = put64(out, conn->dropped);
+	out = put64(out, conn->peakBytes);
+	out = put64(out, conn->origin);
+	out = put32(out, conn->inLen);
+	out = put32(out, conn->outOffset);
+	put32(out, conn->outLen);
+}
+
+static void unpackHandoffConn(const char* in, HandoffConn* conn)
+{
+	memcpy(conn->name, in, sizeof(conn->name));
+	conn->name[MAX_NAME_LEN] = '\0';
+	in += sizeof(conn->name);
+	conn->ready = *in++ != 0;
+	conn->multicast = *in++ != 0;
+	in = get64(in, &conn->session);
+	in = get64(in, &conn->lastClientSeq);
+	in = get64(in, &conn->gapFrom);
+	in = get64(in, &conn->gapTo);
+	in = get64(in, &conn->dropped);
+	in = get64(in, &conn->peakBytes);
+	in = get64(in, &conn->origin);
+	in = get32(in, &conn->inLen);
+	in = get32(in, &conn->outOffset);
+	get32(in, &conn->outLen);
+}
+
+static ssize_t sendPacket(int sock, const void* data, size_t len, int fd) // fd rides along unless it's -1
+{
+	struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if (fd != -1) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static ssize_t recvPacket(int sock, char* data, size_t cap, int* fd) // A whole packet, and the fd if fd isn't NULL
+{
+	struct iovec iov = { .iov_base = data, .iov_len = cap };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+
+	ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (len <= 0 || (msg.msg_flags & MSG_TRUNC))
+		return -1;
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	bool has_fd = cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS;
+	if (has_fd && fd)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	else if (has_fd) // Not expecting one, don't leak it
+		close(*(int*)CMSG_DATA(cmsg));
+	return !fd || has_fd ? len : -1;
+}
+
+static bool isMovable(Connection* conn) // File transfers live in pipes halfway through a frame, those can't move
+{
+	return conn->activeUploads == 0 && !conn->chunkPending && conn->bulkLeft == 0;
+}
+
+static HandoffPacket* queuePacket(Server* server, uint32_t len, int fd, Frame* frame) // NULL when out of memory
+{
+	HandoffPacket* packet = malloc(sizeof(HandoffPacket) + (frame ? 0 : len));
+	if (!packet)
+		return NULL;
+
+	packet->next = NULL;
+	packet->fd = fd;
+	packet->len = frame ? frame->len : len;
+	packet->frame = frame;
+	if (frame)
+		frame->refs++;
+
+	if (server->handoffTail)
+		server->handoffTail->next = packet;
+	else
+		server->handoffHead = packet;
+	server->handoffTail = packet;
+	return packet;
+}
+
+static bool packConnection(Server* server, int i)
+{
+	Connection* conn = &server->conns[i];
+
+	HandoffConn record = {
+		.ready = conn->ready,
+		.multicast = conn->multicast,
+		.session = conn->session,
+		.lastClientSeq = conn->lastClientSeq,
+		.gapFrom = conn->gapFrom,
+		.gapTo = conn->gapTo,
+		.dropped = conn->dropped,
+		.peakBytes = conn->peakBytes,
+		.origin = conn->origin,
+		.inLen = conn->inLen,
+		.outOffset = conn->outOffset,
+	};
+	memcpy(record.name, conn->name, sizeof(record.name));
+	for (Output* out = conn->outHead; out; out = out->next)
+		record.outLen += out->frame->len;
+
+	HandoffPacket* packet = queuePacket(server, HANDOFF_CONN_LEN + conn->inLen, server->fds[i].fd, NULL);
+	if (!packet)
+		return false;
+	packHandoffConn(packet->data, &record);
+	memcpy(packet->data + HANDOFF_CONN_LEN, conn->in, conn->inLen);
+
+	for (Output* out = conn->outHead; out; out = out->next) {
+		if (!queuePacket(server, 0, -1, out->frame))
+			return false;
+	}
+	return true;
+}
+
+static void dropPackets(Server* server)
+{
+	while (server->handoffHead) {
+		HandoffPacket* packet = server->handoffHead;
+		server->handoffHead = packet->next;
+		if (packet->frame)
+			releaseFrame(packet->frame);
+		free(packet);
+	}
+	server->handoffTail = NULL;
+}
+
+static void abortHandoff(Server* server, const char* why) // Carry on as if the new server never showed up
+{
+	printError("Handoff failed, carrying on => %s\n", why);
+	dropPackets(server);
+	close(server->handoffPeer);
+	server->handoffPeer = -1;
+
+	server->fds[0].events = POLLIN;
+	server->fds[1].fd = server->handoff_socket;
+	server->fds[1].events = POLLIN;
+	for (int i = server->listeners; i < server->nfds; i++) {
+		if (server->fds[i].fd != -1)
+			updateEvents(server, i);
+	}
+}
+
+static void startHandoff(Server* server) // A new server wants our clients, pack up everything it gets
+{
+	int sock = accept4(server->handoff_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sock == -1)
+		return;
+
+	printMsg("Handing off to a new server\n");
+	for (int i = server->listeners; i < server->nfds; i++) {
+		if (server->fds[i].fd != -1 && !isMovable(&server->conns[i])) {
+			printWarning("Connection %d is in the middle of a file transfer, it has to reconnect\n", server->fds[i].fd);
+			closeConnection(server, i);
+		}
+	}
+
+	// From here on the peer takes the handoff listener's place in the poll and nobody else gets a turn
+	server->handoffPeer = sock;
+	server->handoffDeadline = server->now + HANDOFF_TIMEOUT_SEC * 1000;
+	server->fds[0].events = 0;
+	server->fds[1].fd = sock;
+	server->fds[1].events = POLLOUT;
+	for (int i = server->listeners; i < server->nfds; i++)
+		server->fds[i].events = 0;
+
+	HandoffHeader header = { .seq = server->seq, .nextTransfer = server->nextTransfer, .nextOrigin = server->nextOrigin };
+	memcpy(header.mcastGroup, server->mcastGroup, sizeof(header.mcastGroup));
+	uint64_t from = server->seq >= HISTORY_SIZE ? server->seq - HISTORY_SIZE + 1 : 1;
+	for (uint64_t seq = from; seq <= server->seq; seq++)
+		header.history += server->history[seq % HISTORY_SIZE].seq == seq;
+	for (int i = server->listeners; i < server->nfds; i++)
+		header.conns += server->fds[i].fd != -1;
+
+	HandoffPacket* packet = queuePacket(server, HANDOFF_HEADER_LEN, server->server_socket, NULL);
+	bool ok = packet != NULL;
+	if (ok)
+		packHandoffHeader(packet->data, &header);
+
+	for (uint64_t seq = from; ok && seq <= server->seq; seq++) {
+		HistoryEntry* entry = &server->history[seq % HISTORY_SIZE];
+		if (entry->seq != seq)
+			continue;
+
+		HandoffEntry record = { .seq = entry->seq, .session = entry->session, .clientSeq = entry->clientSeq, .len = entry->frame->len };
+		packet = queuePacket(server, HANDOFF_ENTRY_LEN + record.len, -1, NULL);
+		ok = packet != NULL;
+		if (ok) {
+			packHandoffEntry(packet->data, &record);
+			memcpy(packet->data + HANDOFF_ENTRY_LEN, entry->frame->data, record.len);
+		}
+	}
+	for (int i = server->listeners; ok && i < server->nfds; i++) {
+		if (server->fds[i].fd != -1)
+			ok = packConnection(server, i);
+	}
+
+	if (!ok)
+		abortHandoff(server, "out of memory");
+}
+
+static bool driveHandoff(Server* server, short revents) // Return true once the new server has everything
+{
+	if (revents & (POLLERR | POLLNVAL)) {
+		abortHandoff(server, "the new server went away");
+		return false;
+	}
+
+	while (server->handoffHead) {
+		HandoffPacket* packet = server->handoffHead;
+		ssize_t sent = sendPacket(server->handoffPeer, packet->frame ? packet->frame->data : packet->data, packet->len, packet->fd);
+		if (sent == -1 && (errno == EAGAIN || errno == EINTR))
+			return false;
+		if (sent != (ssize_t)packet->len) {
+			abortHandoff(server, strerror(errno));
+			return false;
+		}
+
+		server->handoffHead = packet->next;
+		if (!server->handoffHead)
+			server->handoffTail = NULL;
+		if (packet->frame)
+			releaseFrame(packet->frame);
+		free(packet);
+	}
+	server->fds[1].events = POLLIN;
+
+	// Only the new process answering means it owns the clients now
+	char done;
+	ssize_t got = recv(server->handoffPeer, &done, 1, 0);
+	if (got == 1)
+		return true;
+	if (got == 0 || (errno != EAGAIN && errno != EINTR))
+		abortHandoff(server, got == 0 ? "the new server gave up" : strerror(errno));
+	return false;
+}
+
+static Frame* copyFrame(const char* data, uint32_t len)
+{
+	Frame* frame = poolAlloc(sizeof(Frame) + len);
+	if (!frame)
+		return NULL;
+	memcpy(frame->data, data, len);
+	frame->refs = 1;
+	frame->len = len;
+	return frame;
+}
+
+static bool recvConnection(Server* server, int sock, char* scratch, bool same_group)
+{
+	HandoffConn record;
+	int fd;
+	ssize_t len = recvPacket(sock, scratch, HANDOFF_PACKET, &fd);
+	if (len < HANDOFF_CONN_LEN)
+		return false;
+	unpackHandoffConn(scratch, &record);
+	if (HANDOFF_CONN_LEN + record.inLen != len || record.inLen > FRAME_HEADER_LEN + MAX_BUFFER_SIZE) {
+		close(fd);
+		return false;
+	}
+
+	bool room = server->nfds - server->listeners < server->max_clients;
+	int i = server->nfds;
+	Connection* conn = &server->conns[i];
+	if (!room) {
+		printWarning("No room for connection %d, raise -c\n", fd);
+		close(fd);
+	} else {
+		server->nfds++;
+		initConnection(conn);
+		server->fds[i].fd = fd;
+		tuneSocket(server, fd);
+		memcpy(conn->name, record.name, sizeof(conn->name));
+		conn->ready = record.ready;
+		conn->session = record.session;
+		conn->lastClientSeq = record.lastClientSeq;
+		conn->gapFrom = record.gapFrom;
+		conn->gapTo = record.gapTo;
+		conn->dropped = record.dropped;
+		conn->peakBytes = record.peakBytes;
+		conn->multicast = record.multicast && same_group; // Otherwise it's back to TCP
+		conn->origin = record.origin;
+		if (conn->ready)
+			addName(server, conn->name, i);
+
+		if (record.inLen > 0) {
+			conn->in = poolAlloc(FRAME_HEADER_LEN + MAX_BUFFER_SIZE);
+			if (!conn->in)
+				return false;
+			memcpy(conn->in, scratch + HANDOFF_CONN_LEN, record.inLen);
+			conn->inLen = record.inLen;
+		}
+
+		// The hello it said to the old server, so a replay of our capture gets the name too
+		conn->captureId = ++server->nextCaptureId;
+		captureEvent(server, i, CAPTURE_CONNECT, NULL, 0);
+		if (conn->ready && server->capture) {
+			uint32_t name_len = strlen(conn->name);
+			FrameHeader hello = { .type = FRAME_HELLO, .flags = PROTOCOL_VERSION, .len = name_len, .aux = conn->session };
+			packHeader(scratch, &hello);
+			memcpy(scratch + FRAME_HEADER_LEN, conn->name, name_len);
+			captureEvent(server, i, CAPTURE_FRAME, scratch, FRAME_HEADER_LEN + name_len);
+		}
+	}
+
+	// Queued frames come one packet each, so they can still be dropped one by one
+	for (uint32_t left = record.outLen; left > 0;) {
+		FrameHeader header;
+		len = recvPacket(sock, scratch, HANDOFF_PACKET, NULL);
+		if (len < FRAME_HEADER_LEN || len > left)
+			return false;
+		unpackHeader(scratch, &header);
+		if (FRAME_HEADER_LEN + header.len != len)
+			return false;
+		left -= len;
+		if (!room)
+			continue;
+
+		Frame* frame = copyFrame(scratch, len);
+		bool ok = frame && appendOutput(server, i, frame);
+		releaseFrame(frame);
+		if (!ok)
+			return false;
+	}
+	if (!room)
+		return true;
+
+	conn->outOffset = record.outOffset;
+	conn->outBytes -= record.outOffset;
+	updateEvents(server, i);
+	return true;
+}
+
+static bool takeOver(Server* server, int sock) // Return false if the old server didn't hand everything over
+{
+	char scratch[HANDOFF_PACKET];
+	HandoffHeader header;
+	if (recvPacket(sock, scratch, sizeof(scratch), &server->server_socket) != HANDOFF_HEADER_LEN
+	    || !unpackHandoffHeader(scratch, &header))
+		return false;
+
+	server->seq = header.seq;
+	server->nextTransfer = header.nextTransfer;
+	server->nextOrigin = header.nextOrigin;
+	bool same_group = server->mcast_socket != -1 && strcmp(header.mcastGroup, server->mcastGroup) == 0;
+
+	for (uint32_t h = 0; h < header.history; h++) {
+		HandoffEntry record;
+		ssize_t len = recvPacket(sock, scratch, sizeof(scratch), NULL);
+		if (len < HANDOFF_ENTRY_LEN)
+			return false;
+		unpackHandoffEntry(scratch, &record);
+		if (HANDOFF_ENTRY_LEN + record.len != len)
+			return false;
+
+		HistoryEntry* entry = &server->history[record.seq % HISTORY_SIZE];
+		entry->frame = copyFrame(scratch + HANDOFF_ENTRY_LEN, record.len);
+		if (!entry->frame)
+			return false;
+		entry->seq = record.seq;
+		entry->session = record.session;
+		entry->clientSeq = record.clientSeq;
+	}
+
+	for (uint32_t c = 0; c < header.conns; c++) {
+		if (!recvConnection(server, sock, scratch, same_group))
+			return false;
+	}
+
+	return send(sock, "", 1, MSG_NOSIGNAL) == 1;
+}
+
+static bool initHandoff(Server* server, const char* path) // Take over from a server at path if there is one, then listen there
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printError("Handoff path %s is too long!\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return false;
+
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		struct timeval limit = { .tv_sec = HANDOFF_TIMEOUT_SEC };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+		if (!takeOver(server, sock)) {
+			printError("Couldn't take over from the running server => errno:%s\n", strerror(errno));
+			close(sock);
+			return false;
+		}
+		printMsg("Took over %d clients at seq %llu\n", server->nfds - server->listeners, (unsigned long long)server->seq);
+	}
+	close(sock);
+
+	// Whatever was at path is gone or done
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(path);
+	mode_t mask = umask(077); // Only our user gets to take the clients
+	bool ok = sock != -1 && bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(sock, 1) == 0;
+	umask(mask);
+	if (!ok) {
+		printError("Couldn't listen for handoffs on %s => errno:%s\n", path, strerror(errno));
+		return false;
+	}
+
+	server->handoff_socket = sock;
+	server->fds[1].fd = sock;
+	server->fds[1].events = POLLIN;
+	return true;
+}
+
+static bool initMulticast(Server* server, const char* spec) // spec is group:port[:interface address]
+{
+	char group[INET_ADDRSTRLEN], interface[INET_ADDRSTRLEN] = "";
+	unsigned short port;
+	struct in_addr local = { .s_addr = INADDR_ANY };
+
+	if (sscanf(spec, "%15[0-9.]:%hu:%15[0-9.]", group, &port, interface) < 2 || port == 0
+	    || inet_pton(AF_INET, group, &server->mcastAddr.sin_addr) != 1 || !IN_MULTICAST(ntohl(server->mcastAddr.sin_addr.s_addr))
+	    || (interface[0] && inet_pton(AF_INET, interface, &local) != 1)) {
+		printError("%s isn't a multicast group:port[:interface]!\n", spec);
+		return false;
+	}
+	server->mcastAddr.sin_family = AF_INET;
+	server->mcastAddr.sin_port = htons(port);
+	snprintf(server->mcastGroup, sizeof(server->mcastGroup), "%s:%hu", group, port);
+
+	// Clients on this host are in the group too, and the LAN is as far as it goes
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	unsigned char loop = 1, ttl = 1;
+	if (sock == -1 || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1
+	    || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1
+	    || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == -1) {
+		printError("Couldn't set up multicast on %s => errno:%s\n", spec, strerror(errno));
+		if (sock != -1)
+			close(sock);
+		return false;
+	}
+
+	server->mcast_socket = sock;
+	printMsg("Publishing messages to %s\n", server->mcastGroup);
+	return true;
+}
+
+static bool initCapture(Server* server, const char* path)
+{
+	server->capture = fopen(path, "wbe");
+	if (!server->capture || setvbuf(server->capture, NULL, _IOFBF, CAPTURE_BUFFER_SIZE) != 0
+	    || fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, server->capture) != 1) {
+		printError("Couldn't start the capture in %s => errno:%s\n", path, strerror(errno));
+		return false;
+	}
+
+	server->capturedAt = monotonicUs();
+	printMsg("Recording inbound traffic to %s\n", path);
+	return true;
+}
+
+static uint64_t monotonicMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t lagOf(Server* server, Connection* conn) // ms the oldest output still waiting has been queued
+{
+	uint64_t since = server->now;
+	if (conn->outHead && conn->outHead->queuedAt < since)
+		since = conn->outHead->queuedAt;
+	if (conn->bulkLeft > 0 && conn->bulkSince < since)
+		since = conn->bulkSince;
+	return server->now - since;
+}
+
+static void dropLaggards(Server* server) // Whatever the policy, a client this far behind is gone
+{
+	for (int i = server->listeners; i < server->nfds && server->backlogged > 0; i++) {
+		Connection* conn = &server->conns[i];
+		if (server->fds[i].fd == -1 || !conn->backlogged || lagOf(server, conn) <= server->lagMs)
+			continue;
+
+		printWarning("Connection %d is %llu ms behind, dropping it\n", server->fds[i].fd,
+			     (unsigned long long)lagOf(server, conn));
+		server->lagDisconnects++;
+		closeConnection(server, i);
+	}
+}
+
+static void printStats(Server* server)
+{
+	size_t tables = (server->max_clients + 2) * (sizeof(struct pollfd) + sizeof(Connection))
+		+ (server->nameMask + 1) * (sizeof(NameSlot) + sizeof(SessionSlot));
+
+	printMsg("Memory: %zu of %zu KiB of buffers reserved, %llu allocations refused, %zu KiB of tables for %d clients (%d connected)\n",
+		 memoryReserved >> 10, memoryBudget >> 10, (unsigned long long)memoryRefused, tables >> 10,
+		 server->max_clients, server->nfds - server->listeners);
+	for (size_t p = 0; p < POOL_COUNT; p++) {
+		printMsg("  %6u byte blocks: %zu in use, %zu at peak, %zu slabs\n",
+			 pools[p].size, pools[p].used, pools[p].peak, pools[p].slabs);
+	}
+
+	printMsg("Lag: %s past %zu KiB or %llu s, %llu messages dropped, %llu clients dropped, %d behind right now\n",
+		 lagPolicyNames[server->lagPolicy], server->lagBytes >> 10, (unsigned long long)server->lagMs / 1000,
+		 (unsigned long long)server->lagDropped, (unsigned long long)server->lagDisconnects, server->backlogged);
+	int listed = 0;
+	for (int i = server->listeners; i < server->nfds && listed < 16; i++) {
+		Connection* conn = &server->conns[i];
+		if (server->fds[i].fd == -1 || (!conn->backlogged && conn->dropped == 0))
+			continue;
+
+		printMsg("  %d %s: %zu bytes and %llu ms behind, %llu dropped, %zu bytes at peak\n",
+			 server->fds[i].fd, conn->name, conn->outBytes + conn->bulkLeft,
+			 (unsigned long long)lagOf(server, conn), (unsigned long long)conn->dropped, conn->peakBytes);
+		listed++;
+	}
+
+	if (server->mcast_socket != -1) {
+		int joined = 0;
+		for (int i = server->listeners; i < server->nfds; i++)
+			joined += server->fds[i].fd != -1 && server->conns[i].multicast;
+		printMsg("Multicast: %s, %llu datagrams, %llu failed, %d clients joined\n", server->mcastGroup,
+			 (unsigned long long)server->published, (unsigned long long)server->publishFailed, joined);
+	}
+}
+
+static bool allocTables(Server* server, int max_clients) // Sized once, idle clients cost nothing past their slot
+{
+	uint32_t name_slots = 16;
+	while (name_slots < 2 * (uint32_t)(max_clients + 1))
+		name_slots *= 2;
+
+	server->max_clients = max_clients;
+	server->fds = calloc(max_clients + 2, sizeof(struct pollfd));
+	server->conns = calloc(max_clients + 2, sizeof(Connection));
+	server->names = calloc(name_slots, sizeof(NameSlot));
+	server->sessions = calloc(name_slots, sizeof(SessionSlot));
+	server->nameMask = name_slots - 1;
+	if (!server->fds || !server->conns || !server->names || !server->sessions)
+		return false;
+
+	// Every client is a socket, make sure we may have that many
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (limit.rlim_cur < (rlim_t)max_clients + 16)
+		printWarning("Only %llu file descriptors allowed, fewer than %d clients will fit\n",
+			     (unsigned long long)limit.rlim_cur, max_clients);
+	return true;
+}
+
+static volatile sig_atomic_t statsRequested = 0;
+
+static void requestStats(int sig)
+{
+	(void)sig;
+	statsRequested = 1;
+}
+
+#ifdef WIRED_TRACE
+static volatile sig_atomic_t traceRequested = 0;
+
+static void requestTrace(int sig)
+{
+	(void)sig;
+	traceRequested = 1;
+}
+#endif
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int sig)
+{
+	(void)sig;
+	stopRequested = 1;
+}
+
+static Server server = { 0 }; // Too big for the stack
+
+int main(int argc, char** argv)
+{
+	Result result = SUCCESS;
+	int max_clients = DEFAULT_MAX_CLIENTS;
+	int lag_policy = LAG_DISCONNECT;
+	int lag_kb = DEFAULT_LAG_KB;
+	int lag_seconds = DEFAULT_LAG_SECONDS;
+	const char* handoff_path = NULL;
+	int busy_cpu = -1;
+	const char* multicast = NULL;
+	const char* capture_path = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:m:p:l:t:u:b:g:r:")) != -1) {
+		switch (opt) {
+		case 'c':
+			max_clients = atoi(optarg);
+			break;
+		case 'm':
+			memoryBudget = (size_t)atoi(optarg) << 20;
+			break;
+		case 'p':
+			lag_policy = -1;
+			for (int p = 0; p < (int)(sizeof(lagPolicyNames) / sizeof(lagPolicyNames[0])); p++) {
+				if (strcmp(optarg, lagPolicyNames[p]) == 0)
+					lag_policy = p;
 			}
+			break;
+		case 'l':
+			lag_kb = atoi(optarg);
+			break;
+		case 't':
+			lag_seconds = atoi(optarg);
+			break;
+		case 'u':
+			handoff_path = optarg;
+			break;
+		case 'b':
+			busy_cpu = atoi(optarg);
+			break;
+		case 'g':
+			multicast = optarg;
+			break;
+		case 'r':
+			capture_path = optarg;
+			break;
+		default:
+			max_clients = 0;
+		}
+	}
+
+	if (max_clients <= 0 || memoryBudget == 0 || lag_policy < 0 || lag_kb <= 0 || lag_seconds < 0 || busy_cpu < -1) {
+		fprintf(stderr, "Usage: %s [-c max clients] [-m buffer memory budget in MiB]\n"
+			"\t[-p disconnect|drop-oldest|drop-newest] [-l lag limit in KiB] [-t lag limit in seconds, 0 for none]\n"
+			"\t[-u handoff socket path, a server started with the same path takes over the clients]\n"
+			"\t[-b cpu, low latency mode: pin to it and busy poll instead of sleeping]\n"
+			"\t[-g group:port[:interface address], publish messages to a multicast group as well]\n"
+			"\t[-r capture file, record inbound traffic for the replay tool]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
 
-			if (fds[i].fd == server_socket) { // the shit is a new connection
-				if (!acceptConnection(send_buffer, server_socket, fds, &nfds)) {
+	server.lagPolicy = lag_policy;
+	server.lagBytes = (size_t)lag_kb << 10;
+	server.lagMs = (uint64_t)lag_seconds * 1000;
+	server.busyCpu = busy_cpu;
+
+	if (busy_cpu >= 0) { // Trade a core for never waiting on the scheduler to wake us
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(busy_cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			printError("Couldn't pin to CPU %d => errno:%s\n", busy_cpu, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		printMsg("Low latency mode, busy polling on CPU %d\n", busy_cpu);
+	}
+
+	if (!allocTables(&server, max_clients)) {
+		printError("Couldn't allocate tables for %d clients!\n", max_clients);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN); // splice has no MSG_NOSIGNAL, a receiver hanging up mid file must not kill us
+	signal(SIGUSR1, requestStats); // kill -USR1 dumps the memory accounting
+#ifdef WIRED_TRACE
+	signal(SIGUSR2, requestTrace); // kill -USR2 dumps the trace ring
+	signal(SIGINT, requestStop); // So does stopping, with whatever led up to it
+	signal(SIGTERM, requestStop);
+#endif
+	initSanitizer();
+
+	server.server_socket = -1;
+	server.handoff_socket = -1;
+	server.handoffPeer = -1;
+	server.mcast_socket = -1;
+	server.listeners = handoff_path ? 2 : 1;
+	server.nfds = server.listeners;
+	server.now = monotonicMs();
+	server.lastActivity = server.now;
+	if (multicast && !initMulticast(&server, multicast))
+		return EXIT_FAILURE;
+	if (capture_path && !initCapture(&server, capture_path))
+		return EXIT_FAILURE;
+	if (capture_path) { // Stop cleanly so the capture doesn't end halfway through a record
+		signal(SIGINT, requestStop);
+		signal(SIGTERM, requestStop);
+	}
+	if (handoff_path && !initHandoff(&server, handoff_path))
+		return EXIT_FAILURE;
+
+	if (server.server_socket == -1) { // Nobody handed us one
+		result = initServer(&server.server_socket);
+		CHECK_RESULT(result);
+	}
+
+	server.devnull = open("/dev/null", O_WRONLY);
+	if (server.devnull == -1) {
+		printError("Couldn't open /dev/null => errno:%s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	bool end_server = false;
+	const int timeout = (6 * 60 * 1000); // 6 min
+	int current_size = 0;
+	server.fds[0].fd = server.server_socket;
+	server.fds[0].events = POLLIN;
+
+	do {
+		// Wake up now and then while somebody is behind, so the lag limit holds without traffic.
+		// In low latency mode never sleep: spin, and only yield after a long enough quiet spell.
+		int wait = server.lagMs > 0 && server.backlogged > 0 ? LAG_CHECK_MS : timeout;
+		if (server.mcast_socket != -1 && wait > MULTICAST_HEARTBEAT_MS)
+			wait = MULTICAST_HEARTBEAT_MS;
+		if (server.captureDirty && wait > CAPTURE_FLUSH_MS)
+			wait = CAPTURE_FLUSH_MS;
+		if (server.handoffPeer != -1) {
+			uint64_t left = server.handoffDeadline > server.now ? server.handoffDeadline - server.now : 0;
+			if ((uint64_t)wait > left)
+				wait = left;
+		}
+		if (server.busyCpu >= 0)
+			wait = 0;
+		TRACE_BEGIN(poll);
+		int rc = poll(server.fds, server.nfds, wait);
+		if (rc != 0 || wait > 0) // Empty spins of the low latency mode would flood the ring
+			TRACE_END(poll, wait);
+		TRACE_BEGIN(loop);
+		server.now = monotonicMs();
+
+		if (rc > 0) {
+			server.lastActivity = server.now;
+			server.idleSpins = 0;
+		} else if (rc == 0 && server.busyCpu >= 0 && ++server.idleSpins > SPINS_BEFORE_YIELD) {
+			sched_yield();
+		}
+
+		if (statsRequested) {
+			statsRequested = 0;
+			printStats(&server);
+		}
+
+#ifdef WIRED_TRACE
+		if (traceRequested) {
+			traceRequested = 0;
+			traceDump();
+		}
+#endif
+
+		if (stopRequested)
+			break;
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc < 0)
+		{
+			result = ERROR_POLL_FAIL;
+			break;
+		}
+
+		if (rc == 0 && server.captureDirty) { // Quiet for a moment, a good time to write it out
+			server.captureDirty = false;
+			fflush(server.capture);
+		}
+
+		if (server.handoffPeer != -1 && server.now >= server.handoffDeadline)
+			abortHandoff(&server, "the new server didn't answer in time");
+
+		if (rc == 0 && server.now - server.lastActivity >= (uint64_t)timeout)
+		{
+			result = ERROR_POLL_TIMEOUT;
+			break;
+		}
+
+		current_size = server.nfds;
+		for (int i = 0; i < current_size; i++) {
+			short revents = server.fds[i].revents;
+			if(revents == 0 || server.fds[i].fd == -1)
+				continue;
+
+			if (server.fds[i].fd == server.server_socket) { // the shit is a new connection
+				if (revents != POLLIN) {
+					result = ERROR_POLL_REVENTS;
+					end_server = true;
+					break;
+				}
+
+				TRACE_BEGIN(accept);
+				bool accepted = acceptConnection(&server);
+				TRACE_END(accept, server.nfds);
+				if (!accepted) {
 					result = ERROR_SERVER_ACCEPT;
 					end_server = true;
 					break;
 				}
-			} else {
-				if (!handleConnection(send_buffer, recv_buffer, fds[i].fd, server_socket, fds, nfds)) {
-					close(fds[i].fd);
-					fds[i].fd = -1;
-					compress_array = true;
+				continue;
+			}
+
+			if (server.fds[i].fd == server.handoff_socket) { // A new server wants our clients
+				TRACE_BEGIN(handoff);
+				startHandoff(&server);
+				TRACE_END(handoff, server.nfds);
+				break; // Nobody else gets a turn until it's over
+			}
+
+			if (server.fds[i].fd == server.handoffPeer) {
+				if (driveHandoff(&server, revents)) {
+					printMsg("Handed off, bye\n");
+					end_server = true;
 				}
+				break;
+			}
+			if (server.handoffPeer != -1) // Clients wait until the new server has them or gave up
+				break;
+
+			bool ok = !(revents & (POLLERR | POLLNVAL));
+			if (!ok)
+				printWarning("Connection %d failed\n", server.fds[i].fd);
+			if (ok && (revents & (POLLIN | POLLHUP))) {
+				TRACE_BEGIN(recv);
+				ok = handleConnection(&server, i);
+				TRACE_END(recv, i);
 			}
+			if (ok && server.fds[i].fd != -1 && (revents & POLLOUT)) {
+				TRACE_BEGIN(flush);
+				ok = flushConnection(&server, i);
+				TRACE_END(flush, i);
+			}
+			if (!ok)
+				closeConnection(&server, i);
 		}
 
-		if (compress_array) {
-			compress_array = false;
-			for (int i = 0; i < nfds; i++) {
-				if (fds[i].fd == -1) {
-					for(int j = i; j < nfds - 1; j++) {
-						fds[j].fd = fds[j + 1].fd;
-					}
-					i--;
-					nfds--;
+		if (end_server)
+			break;
+
+		if (server.mcast_socket != -1 && server.now - server.publishedAt >= MULTICAST_HEARTBEAT_MS)
+			publishHeartbeat(&server);
+
+		if (server.lagMs > 0 && server.backlogged > 0 && server.handoffPeer == -1 && server.now - server.lagCheckedAt >= LAG_CHECK_MS) {
+			server.lagCheckedAt = server.now;
+			TRACE_BEGIN(dropLaggards);
+			dropLaggards(&server);
+			TRACE_END(dropLaggards, server.backlogged);
+		}
+
+		if (server.compress_array) { // One pass, however many went away
+			TRACE_BEGIN(compress);
+			server.compress_array = false;
+			int kept = 0;
+			for (int i = 0; i < server.nfds; i++) {
+				if (server.fds[i].fd == -1)
+					continue;
+
+				if (kept != i) {
+					server.fds[kept] = server.fds[i];
+					server.conns[kept] = server.conns[i];
+					if (server.conns[kept].ready)
+						server.names[findName(&server, server.conns[kept].name)].conn = kept;
 				}
+				kept++;
 			}
+			server.nfds = kept;
+			TRACE_END(compress, kept);
 		}
+
+		if (rc != 0 || wait > 0)
+			TRACE_END(loop, rc);
 	} while (!end_server);
 
-	for (int i = 0; i < nfds; i++) {
-		if(fds[i].fd >= 0)
-			close(fds[i].fd);
+	for (int i = 0; i < server.nfds; i++) {
+		if(server.fds[i].fd >= 0)
+			close(server.fds[i].fd);
 	}
+	if (server.capture)
+		fclose(server.capture);
+#ifdef WIRED_TRACE
+	traceDump(); // Whatever led up to the end
+#endif
 
 	CHECK_RESULT(result);
 }
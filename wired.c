@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // memrchr()
+
 #include <ncurses.h>
 #include <form.h>
 #include <stdarg.h>
@@ -6,63 +8,737 @@
 #include <string.h>
 #include <errno.h>
 #include <locale.h>
+#include <limits.h>
 #include <ctype.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "ansi_colors.h"
+#include "protocol.h"
+#include "sanitize.h"
 
 #define CTRL(x) ((x) & 0x1f)
 
-#define MAX_MESSAGE_HISTORY 50
-#define MAX_BUFFER_SIZE 1024
-#define MAX_NAME_LEN 30
+#define MAX_MESSAGE_HISTORY (1 << 20) // Messages kept in memory before the oldest get evicted
+#define MESSAGE_EVICT_COUNT (MAX_MESSAGE_HISTORY / 4)
+#define INITIAL_MESSAGE_CAPACITY 256
+#define MAX_TOKEN_LEN 64
+#define MAX_QUERY_LEN 128
+#define TOKEN_INDEX_INITIAL_CAPACITY 1024 // Must be a power of two
+#define CACHE_PAGE_MESSAGES 200 // Messages pulled from the history cache at a time
+#define CONNECT_TIMEOUT_MS 3000
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 16000
+#define MAX_TRANSFERS 8
+#define MAX_FILE_NAME_LEN 64
+#define DOWNLOAD_DIR "wired-downloads"
+#define MAX_DOWNLOAD_COPIES 100 // Names tried for a download before giving up
+#define DEFAULT_MAX_DOWNLOAD_MB 1024 // Bigger offers are turned down, WIRED_MAX_DOWNLOAD_MB overrides it
+#define TRACE_SIZE 64 // Arrivals kept for the latency overlay
+#define CONTROL_BUFFER_SIZE (16 * FRAME_HEADER_LEN) // Join and resend requests waiting to go out
+#define MULTICAST_TIMEOUT_MS (4 * MULTICAST_HEARTBEAT_MS) // A group this quiet lost us, TCP takes over again
+
+// Token index: lowercase word -> ids of the messages containing it
+typedef struct {
+	int* ids;
+	int count;
+	int capacity;
+} IdList;
+
+typedef struct {
+	char* token;
+	IdList newer; // ascending, messages added at the end of the history
+	IdList older; // descending, messages loaded from the cache in front of the history
+} Posting;
+
+typedef struct {
+	Posting* slots; // Open addressing, linear probing
+	int capacity;
+	int used;
+} TokenIndex;
+
+static uint32_t hashToken(const char* token, int len) // FNV-1a
+{
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		h ^= (unsigned char)token[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static bool initTokenIndex(TokenIndex* index)
+{
+	index->capacity = TOKEN_INDEX_INITIAL_CAPACITY;
+	index->used = 0;
+	index->slots = calloc(index->capacity, sizeof(Posting));
+	return index->slots != NULL;
+}
+
+static void destroyTokenIndex(TokenIndex* index)
+{
+	if (!index->slots) return;
+	for (int i = 0; i < index->capacity; i++) {
+		free(index->slots[i].token);
+		free(index->slots[i].newer.ids);
+		free(index->slots[i].older.ids);
+	}
+	free(index->slots);
+	index->slots = NULL;
+}
+
+static Posting* probeToken(Posting* slots, int capacity, const char* token, int len)
+{
+	uint32_t mask = capacity - 1;
+	uint32_t i = hashToken(token, len) & mask;
+	while (slots[i].token) {
+		if (strncmp(slots[i].token, token, len) == 0 && slots[i].token[len] == '\0')
+			break;
+		i = (i + 1) & mask;
+	}
+	return &slots[i];
+}
+
+static bool growTokenIndex(TokenIndex* index)
+{
+	int capacity = index->capacity * 2;
+	Posting* slots = calloc(capacity, sizeof(Posting));
+	if (!slots) return false;
+
+	for (int i = 0; i < index->capacity; i++) {
+		Posting* p = &index->slots[i];
+		if (p->token)
+			*probeToken(slots, capacity, p->token, strlen(p->token)) = *p;
+	}
+
+	free(index->slots);
+	index->slots = slots;
+	index->capacity = capacity;
+	return true;
+}
+
+static Posting* findPosting(TokenIndex* index, const char* token, int len, bool create)
+{
+	Posting* p = probeToken(index->slots, index->capacity, token, len);
+	if (p->token || !create)
+		return p->token ? p : NULL;
+
+	if ((index->used + 1) * 2 > index->capacity) {
+		if (!growTokenIndex(index)) return NULL;
+		p = probeToken(index->slots, index->capacity, token, len);
+	}
+
+	p->token = strndup(token, len);
+	if (!p->token) return NULL;
+	index->used++;
+	return p;
+}
+
+static bool isTokenChar(unsigned char c)
+{
+	return isalnum(c) || c >= 0x80; // Treat every non-ASCII UTF-8 byte as part of a word
+}
+
+// Copies the next lowercased word of text into token and returns the position after it, NULL when there is none
+static const char* nextToken(const char* text, char* token, int* len)
+{
+	while (*text && !isTokenChar(*text))
+		text++;
+
+	if (!*text) return NULL;
+
+	*len = 0;
+	while (isTokenChar(*text)) {
+		if (*len < MAX_TOKEN_LEN) // Long words are indexed by their prefix
+			token[(*len)++] = tolower((unsigned char)*text);
+		text++;
+	}
+	return text;
+}
+
+static bool appendId(IdList* list, int id)
+{
+	if (list->count > 0 && list->ids[list->count - 1] == id)
+		return true;
+
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? list->capacity * 2 : 4;
+		int* ids = realloc(list->ids, capacity * sizeof(int));
+		if (!ids) return false;
+		list->ids = ids;
+		list->capacity = capacity;
+	}
+	list->ids[list->count++] = id;
+	return true;
+}
+
+static void indexMessage(TokenIndex* index, int id, const char* text, bool older)
+{
+	char token[MAX_TOKEN_LEN];
+	int len;
+
+	while ((text = nextToken(text, token, &len))) {
+		Posting* p = findPosting(index, token, len, true);
+		if (!p || !appendId(older ? &p->older : &p->newer, id))
+			return;
+	}
+}
+
+static int lowerBound(const int* ids, int count, int id)
+{
+	int lo = 0, hi = count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (ids[mid] < id) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static void pruneTokenIndex(TokenIndex* index, int first) // Drop ids of evicted messages, and words only they had
+{
+	int live = 0;
+	for (int i = 0; i < index->capacity; i++) {
+		Posting* p = &index->slots[i];
+		if (!p->token) continue;
+
+		while (p->older.count > 0 && p->older.ids[p->older.count - 1] < first)
+			p->older.count--;
+
+		int stale = lowerBound(p->newer.ids, p->newer.count, first);
+		memmove(p->newer.ids, p->newer.ids + stale, (p->newer.count - stale) * sizeof(int));
+		p->newer.count -= stale;
+		if (p->older.count > 0 || p->newer.count > 0) live++;
+	}
+
+	// Emptying slots in place would cut probe chains, so what's left moves to a fresh table.
+	// Without one the empty postings stay, they only cost memory
+	int capacity = index->capacity;
+	while (capacity > TOKEN_INDEX_INITIAL_CAPACITY && live * 4 < capacity)
+		capacity /= 2;
+	Posting* slots = calloc(capacity, sizeof(Posting));
+	if (!slots) return;
+
+	for (int i = 0; i < index->capacity; i++) {
+		Posting* p = &index->slots[i];
+		if (!p->token) continue;
+
+		if (p->older.count > 0 || p->newer.count > 0) {
+			*probeToken(slots, capacity, p->token, strlen(p->token)) = *p;
+		} else {
+			free(p->token);
+			free(p->newer.ids);
+			free(p->older.ids);
+		}
+	}
+
+	free(index->slots);
+	index->slots = slots;
+	index->capacity = capacity;
+	index->used = live;
+}
+
+// Substring scan, compares the first and last needle bytes 16 positions at a time before calling memcmp
+static bool containsSubstring(const char* hay, int hay_len, const char* needle, int needle_len)
+{
+	if (needle_len == 0) return true;
+	if (needle_len > hay_len) return false;
+
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+	for (; i + needle_len - 1 + 16 <= hay_len; i += 16) {
+		__m128i block_first = _mm_loadu_si128((const __m128i*)(hay + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i*)(hay + i + needle_len - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+								_mm_cmpeq_epi8(last, block_last)));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (memcmp(hay + i + bit, needle, needle_len) == 0)
+				return true;
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i + needle_len <= hay_len; i++) {
+		if (hay[i] == needle[0] && memcmp(hay + i, needle, needle_len) == 0)
+			return true;
+	}
+	return false;
+}
+
+// History cache: chat messages, relayed ones and our own once acked, are appended to a
+// per-server file as [uint32 len][len bytes]['\0'][uint32 len]. The trailing length lets
+// startup walk back from the end of the mapping, so only the pages shown get read.
+// Notices and status lines only live on screen.
+#define CACHE_MAGIC "WIREDHC1"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_RECORD_OVERHEAD (2 * sizeof(uint32_t) + 1)
+#define CACHE_MAX_SIZE (16 * 1024 * 1024) // Past it the file moves to .1 and a new one starts
+
+typedef struct {
+	int fd; // -1 when there is no cache
+	const char* map; // Stays mapped until exit, loaded messages point into it
+	size_t mapLen; // As mapped, a file cut by a crash has a partial record past the cursor
+	size_t cursor; // Records before this offset aren't loaded yet
+	size_t size; // Of the file being appended to
+	char path[PATH_MAX];
+} HistoryCache;
+
+static bool isCacheRecord(const char* map, size_t start, size_t end)
+{
+	uint32_t head, tail;
+	if (end - start < CACHE_RECORD_OVERHEAD)
+		return false;
+
+	memcpy(&head, map + start, sizeof(head));
+	memcpy(&tail, map + end - sizeof(tail), sizeof(tail));
+	return head == tail && head + CACHE_RECORD_OVERHEAD == end - start && map[end - sizeof(tail) - 1] == '\0';
+}
+
+static size_t findCacheEnd(const char* map, size_t len) // End of the last complete record, for files cut by a crash
+{
+	size_t end = CACHE_MAGIC_LEN;
+	while (end + sizeof(uint32_t) <= len) {
+		uint32_t head;
+		memcpy(&head, map + end, sizeof(head));
+		size_t next = end + head + CACHE_RECORD_OVERHEAD;
+		if (next > len || !isCacheRecord(map, end, next))
+			break;
+		end = next;
+	}
+	return end;
+}
+
+static void openHistoryCache(HistoryCache* cache, const char* ip, unsigned short port)
+{
+	cache->fd = -1;
+	cache->map = NULL;
+	cache->mapLen = 0;
+	cache->cursor = 0;
+
+	char path[PATH_MAX];
+	const char* xdg = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	if (xdg && *xdg)
+		snprintf(path, sizeof(path), "%s", xdg);
+	else if (home && *home)
+		snprintf(path, sizeof(path), "%s/.cache", home);
+	else
+		return;
+
+	mkdir(path, 0700); // Usually there already
+	strncat(path, "/wired", sizeof(path) - strlen(path) - 1);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return;
+
+	size_t dir_len = strlen(path);
+	snprintf(path + dir_len, sizeof(path) - dir_len, "/%s-%hu.history", ip, port);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (fd == -1)
+		return;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return;
+	}
+
+	size_t len = st.st_size;
+	if (len > 0) {
+		cache->map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		if (cache->map == MAP_FAILED) {
+			cache->map = NULL;
+			close(fd);
+			return;
+		}
+
+		if (len < CACHE_MAGIC_LEN || memcmp(cache->map, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0) {
+			munmap((void*)cache->map, len);
+			cache->map = NULL;
+			len = 0; // Not ours, start over
+		} else {
+			uint32_t tail;
+			memcpy(&tail, cache->map + len - sizeof(tail), sizeof(tail));
+			if (len > CACHE_MAGIC_LEN && (tail + CACHE_RECORD_OVERHEAD > len - CACHE_MAGIC_LEN ||
+						      !isCacheRecord(cache->map, len - tail - CACHE_RECORD_OVERHEAD, len))) {
+				len = findCacheEnd(cache->map, len);
+				if (ftruncate(fd, len) == -1) {
+					munmap((void*)cache->map, st.st_size);
+					close(fd);
+					return;
+				}
+			}
+		}
+	}
+
+	if (len == 0 && (ftruncate(fd, 0) == -1 || write(fd, CACHE_MAGIC, CACHE_MAGIC_LEN) != CACHE_MAGIC_LEN)) {
+		close(fd);
+		return;
+	}
+
+	cache->fd = fd;
+	cache->mapLen = cache->map ? (size_t)st.st_size : 0;
+	cache->cursor = len;
+	cache->size = len ? len : CACHE_MAGIC_LEN;
+	memcpy(cache->path, path, sizeof(path));
+}
+
+static void closeHistoryCache(HistoryCache* cache)
+{
+	if (cache->map) munmap((void*)cache->map, cache->mapLen);
+	if (cache->fd != -1) close(cache->fd);
+	cache->map = NULL;
+	cache->fd = -1;
+}
+
+static bool isCached(const HistoryCache* cache, const char* message)
+{
+	return cache->map && message >= cache->map && message < cache->map + cache->mapLen;
+}
 
-#define SERVER_FULL_STRING "[SERVERISFULL]"
+static void rotateCache(HistoryCache* cache) // The mapping keeps the old file readable
+{
+	char old[PATH_MAX + 2];
+	snprintf(old, sizeof(old), "%s.1", cache->path);
+	close(cache->fd);
+	cache->fd = -1;
+
+	if (rename(cache->path, old) == -1)
+		return;
+	int fd = open(cache->path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd == -1)
+		return;
+	if (write(fd, CACHE_MAGIC, CACHE_MAGIC_LEN) != CACHE_MAGIC_LEN) {
+		close(fd);
+		return;
+	}
+
+	cache->fd = fd;
+	cache->size = CACHE_MAGIC_LEN;
+}
+
+// Only the net thread appends, and never under the message lock: the UI keeps drawing while the disk is slow
+static void appendToCache(HistoryCache* cache, const char* message, uint32_t len)
+{
+	if (cache->fd != -1 && cache->size + len + CACHE_RECORD_OVERHEAD > CACHE_MAX_SIZE)
+		rotateCache(cache);
+	if (cache->fd == -1)
+		return;
+
+	struct iovec iov[4] = {
+		{ .iov_base = &len, .iov_len = sizeof(len) },
+		{ .iov_base = (void*)message, .iov_len = len },
+		{ .iov_base = "", .iov_len = 1 }, // Loaded messages are used in place as strings
+		{ .iov_base = &len, .iov_len = sizeof(len) },
+	};
+
+	// A single O_APPEND write keeps records whole, failures only cost the cache.
+	// The mapping stays, messages loaded from it are still on screen
+	if (writev(cache->fd, iov, 4) != (ssize_t)(len + CACHE_RECORD_OVERHEAD)) {
+		close(cache->fd);
+		cache->fd = -1;
+		return;
+	}
+	cache->size += len + CACHE_RECORD_OVERHEAD;
+}
 
 // Messages
 typedef struct {
-	char* messages[MAX_MESSAGE_HISTORY];
-	int head;
+	char** messages; // messages[i] has the id first + i
+	int* lengths;
+	int first;
 	int size;
+	int capacity;
+	TokenIndex index;
+	HistoryCache cache;
+	pthread_mutex_t lock; // The net thread appends while the UI thread reads
+	bool dirty;
 } Messages;
 
 static bool initMessages(Messages* msgs)
 {
-	msgs->head = 0;
+	msgs->cache.fd = -1;
+	msgs->first = 0;
 	msgs->size = 0;
-	for (int i = 0; i < MAX_MESSAGE_HISTORY; i++) {
-		msgs->messages[i] = malloc(MAX_BUFFER_SIZE);
-		if (!msgs->messages[i])
-			return false;
-	}
+	msgs->capacity = INITIAL_MESSAGE_CAPACITY;
+	msgs->dirty = false;
+	msgs->messages = malloc(msgs->capacity * sizeof(char*));
+	msgs->lengths = malloc(msgs->capacity * sizeof(int));
+	if (!msgs->messages || !msgs->lengths)
+		return false;
 
-	return true;
+	if (pthread_mutex_init(&msgs->lock, NULL) != 0)
+		return false;
+
+	return initTokenIndex(&msgs->index);
 }
 
 static void destroyMessages(Messages* msgs)
 {
-	for (int i = 0; i < MAX_MESSAGE_HISTORY; i++) {
-		if (msgs->messages[i]) free(msgs->messages[i]);
+	if (msgs->messages) {
+		for (int i = 0; i < msgs->size; i++) {
+			if (!isCached(&msgs->cache, msgs->messages[i])) free(msgs->messages[i]);
+		}
+		free(msgs->messages);
 	}
+	if (msgs->lengths) free(msgs->lengths);
+	destroyTokenIndex(&msgs->index);
+	closeHistoryCache(&msgs->cache);
+}
+
+static void evictMessages(Messages* msgs, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (!isCached(&msgs->cache, msgs->messages[i])) free(msgs->messages[i]);
+	}
+
+	msgs->size -= count;
+	msgs->first += count;
+	memmove(msgs->messages, msgs->messages + count, msgs->size * sizeof(char*));
+	memmove(msgs->lengths, msgs->lengths + count, msgs->size * sizeof(int));
+	pruneTokenIndex(&msgs->index, msgs->first);
+
+	// Scrolling back has to bring the evicted messages back before anything older. Those
+	// that came in after startup were never mapped, so past them there is no going back
+	HistoryCache* cache = &msgs->cache;
+	if (msgs->size > 0 && isCached(cache, msgs->messages[0]))
+		cache->cursor = msgs->messages[0] - sizeof(uint32_t) - cache->map;
+	else
+		cache->cursor = CACHE_MAGIC_LEN;
+}
+
+static bool growMessages(Messages* msgs)
+{
+	int capacity = msgs->capacity * 2;
+	char** messages = realloc(msgs->messages, capacity * sizeof(char*));
+	if (!messages) return false;
+	msgs->messages = messages;
+
+	int* lengths = realloc(msgs->lengths, capacity * sizeof(int));
+	if (!lengths) return false;
+	msgs->lengths = lengths;
+
+	msgs->capacity = capacity;
+	return true;
 }
 
 static void addMessage(Messages* msgs, const char* message)
 {
-	int index = (msgs->head + msgs->size) % MAX_MESSAGE_HISTORY;
+	pthread_mutex_lock(&msgs->lock);
 
-	if (msgs->size == MAX_MESSAGE_HISTORY) {
-		msgs->head = (msgs->head + 1) % MAX_MESSAGE_HISTORY;
-	} else {
+	if (msgs->size == MAX_MESSAGE_HISTORY)
+		evictMessages(msgs, MESSAGE_EVICT_COUNT);
+
+	int len = strnlen(message, MAX_BUFFER_SIZE - 1);
+	char* copy = malloc(len + 1);
+
+	if (copy && (msgs->size < msgs->capacity || growMessages(msgs))) {
+		memcpy(copy, message, len);
+		copy[len] = '\0';
+
+		msgs->messages[msgs->size] = copy;
+		msgs->lengths[msgs->size] = len;
+		indexMessage(&msgs->index, msgs->first + msgs->size, copy, false);
 		msgs->size++;
+		msgs->dirty = true;
+	} else {
+		free(copy);
+	}
+
+	pthread_mutex_unlock(&msgs->lock);
+}
+
+// Puts up to count older messages from the cache in front of the history, the caller holds the lock.
+// They point straight into the mapping so the kernel only reads the pages we actually look at.
+static int loadOlderMessages(Messages* msgs, int count)
+{
+	HistoryCache* cache = &msgs->cache;
+	const char* page[CACHE_PAGE_MESSAGES];
+	int lengths[CACHE_PAGE_MESSAGES];
+
+	if (count > CACHE_PAGE_MESSAGES) count = CACHE_PAGE_MESSAGES;
+	if (count > MAX_MESSAGE_HISTORY - msgs->size) count = MAX_MESSAGE_HISTORY - msgs->size;
+
+	size_t cursor = cache->cursor;
+	int loaded = 0; // page[0] is the newest
+	while (loaded < count && cache->map && cache->cursor > CACHE_MAGIC_LEN) {
+		uint32_t len;
+		memcpy(&len, cache->map + cache->cursor - sizeof(len), sizeof(len));
+		if (len + CACHE_RECORD_OVERHEAD > cache->cursor - CACHE_MAGIC_LEN) {
+			cache->cursor = CACHE_MAGIC_LEN; // Damaged, nothing older is reachable
+			break;
+		}
+
+		size_t start = cache->cursor - len - CACHE_RECORD_OVERHEAD;
+		if (!isCacheRecord(cache->map, start, cache->cursor)) {
+			cache->cursor = CACHE_MAGIC_LEN;
+			break;
+		}
+
+		page[loaded] = cache->map + start + sizeof(len);
+		lengths[loaded] = len;
+		loaded++;
+		cache->cursor = start;
+	}
+
+	if (loaded == 0)
+		return 0;
+
+	while (msgs->size + loaded > msgs->capacity) {
+		if (!growMessages(msgs)) {
+			cache->cursor = cursor;
+			return 0;
+		}
+	}
+
+	memmove(msgs->messages + loaded, msgs->messages, msgs->size * sizeof(char*));
+	memmove(msgs->lengths + loaded, msgs->lengths, msgs->size * sizeof(int));
+	msgs->first -= loaded;
+	msgs->size += loaded;
+
+	for (int i = 0; i < loaded; i++) { // Newest first keeps the older postings descending
+		int slot = loaded - 1 - i;
+		msgs->messages[slot] = (char*)page[i];
+		msgs->lengths[slot] = lengths[i];
+		indexMessage(&msgs->index, msgs->first + slot, page[i], true);
 	}
 
-	strncpy(msgs->messages[index], message, MAX_BUFFER_SIZE - 1);
-	msgs->messages[index][MAX_BUFFER_SIZE - 1] = '\0';
+	msgs->dirty = true;
+	return loaded;
 }
 
+// Search
+typedef struct {
+	int* ids; // ascending
+	int count;
+	int capacity;
+	int current; // index into ids, -1 when nothing is selected
+} SearchHits;
+
+static bool addHit(SearchHits* hits, int id)
+{
+	if (hits->count == hits->capacity) {
+		int capacity = hits->capacity ? hits->capacity * 2 : 64;
+		int* ids = realloc(hits->ids, capacity * sizeof(int));
+		if (!ids) return false;
+		hits->ids = ids;
+		hits->capacity = capacity;
+	}
+	hits->ids[hits->count++] = id;
+	return true;
+}
+
+static void searchSubstring(Messages* msgs, const char* query, SearchHits* hits)
+{
+	int query_len = strlen(query);
+	for (int i = 0; i < msgs->size; i++) {
+		if (containsSubstring(msgs->messages[i], msgs->lengths[i], query, query_len))
+			if (!addHit(hits, msgs->first + i)) return;
+	}
+}
+
+static bool collectPosting(const Posting* p, int first, SearchHits* out) // Ascending ids still in the history
+{
+	out->count = 0;
+	for (int i = p->older.count - 1; i >= 0; i--) {
+		if (!addHit(out, p->older.ids[i])) return false;
+	}
+	for (int i = lowerBound(p->newer.ids, p->newer.count, first); i < p->newer.count; i++) {
+		if (!addHit(out, p->newer.ids[i])) return false;
+	}
+	return true;
+}
+
+static void searchWords(Messages* msgs, const char* query, SearchHits* hits) // Every word has to match
+{
+	char token[MAX_TOKEN_LEN];
+	int len;
+	bool first_word = true;
+	SearchHits word = { 0 };
+
+	while ((query = nextToken(query, token, &len))) {
+		Posting* p = findPosting(&msgs->index, token, len, false);
+		if (!p) {
+			hits->count = 0;
+			break;
+		}
+
+		if (!collectPosting(p, msgs->first, first_word ? hits : &word))
+			break;
+
+		if (first_word) {
+			first_word = false;
+			continue;
+		}
+
+		// Intersect in place, both lists are sorted
+		int kept = 0;
+		for (int i = 0, j = 0; i < hits->count && j < word.count;) {
+			if (hits->ids[i] < word.ids[j]) i++;
+			else if (hits->ids[i] > word.ids[j]) j++;
+			else {
+				hits->ids[kept++] = hits->ids[i];
+				i++;
+				j++;
+			}
+		}
+		hits->count = kept;
+	}
+
+	free(word.ids);
+}
+
+// Outbox entry, an encoded MSG frame kept until the server acks it
+typedef struct OutMsg {
+	uint64_t seq;
+	uint32_t len;
+	int64_t sentUs; // When it last went to the kernel, for the round trip
+	struct OutMsg* next;
+	char frame[];
+} OutMsg;
+
+// What the latency overlay shows, newest last
+typedef struct {
+	char kind; // 'm' message, 'd' direct message, 'a' ack for one of ours, 'g' gap
+	uint64_t seq;
+	int64_t latencyUs; // Server stamp to arrival, send to ack for acks
+	uint64_t missed; // Messages we never got right before this one
+} TraceEntry;
+
+typedef enum {
+	NET_ONLINE,
+	NET_RECONNECTING,
+} NetStatus;
+
+typedef struct {
+	bool active;
+	bool incoming;
+	bool begun; // Uploads: the server knows about it
+	uint64_t id; // Ours for uploads, the server's for downloads
+	int fd;
+	char name[MAX_FILE_NAME_LEN + 1];
+	uint64_t size;
+	uint64_t done;
+} Transfer;
+
 // State
 typedef struct {
 	// UI
@@ -75,17 +751,81 @@ typedef struct {
 	FORM   *textForm;
 
 	bool insertMode;
+	bool searchMode;
+	volatile sig_atomic_t resized;
 
 	// NET
 	pthread_t net_thread;
-	int socket;
+	int socket; // -1 while reconnecting
+	struct sockaddr_in addr;
 	char* send_buffer;
-	char* recv_buffer;
+	char* recv_buffer; // Partial inbound frames
+	uint32_t recvLen;
 	char* name;
+	uint64_t session; // Lets the server recognize us after a reconnect
+	uint64_t lastSeq; // Newest server seq we've seen
+	int wakePipe[2]; // The UI thread pokes the net thread through it
+	char hello[FRAME_HEADER_LEN + MAX_NAME_LEN];
+	uint32_t helloLen;
+	uint32_t helloOffset;
+	bool everWelcomed;
+
+	// Multicast: once joined, relayed messages arrive on the group and TCP only fills gaps.
+	// Only the net thread touches these.
+	int mcastSocket; // -1 until a server offers a group
+	char mcastGroup[MAX_GROUP_LEN + 1];
+	bool joining; // Offered a group on the current connection, waiting to hear from it
+	bool multicast; // Joined for the current connection
+	int64_t heardAt; // ms the group last sent anything
+	uint64_t origin; // Marks our own messages in the datagrams
+	uint64_t resendTo; // Newest seq asked for again
+	uint64_t resendWant; // Newest seq to ask for, gaps found between two flushes make one range
+	char* datagram;
+	char control[CONTROL_BUFFER_SIZE];
+	uint32_t controlLen;
+	uint32_t controlOffset;
+
+	// Outbox, shared between the UI and net threads
+	pthread_mutex_t outLock;
+	OutMsg* outHead;
+	OutMsg* outTail;
+	OutMsg* sendNext; // First message not yet written on the current connection
+	uint32_t sendOffset;
+	uint64_t nextSeq;
+	int pending;
+	bool welcomed;
+	NetStatus netStatus;
+	int reconnectAttempts;
+	bool statusDirty;
+
+	// File transfers, chunks only go out while no text is waiting
+	Transfer transfers[MAX_TRANSFERS];
+	uint64_t nextTransfer;
+	int uploadCursor;
+	uint64_t maxDownload; // Bytes
+	char* chunkBuffer;
+	uint32_t chunkLen;
+	uint32_t chunkOffset;
+
+	// Latency overlay, filled by the net thread under outLock
+	bool traceOverlay;
+	TraceEntry trace[TRACE_SIZE];
+	uint64_t traceCount;
+	uint64_t traceMissed;
+	int64_t traceSumUs;
+	int64_t traceMaxUs;
+	uint64_t traceSamples;
 
 	// Messages
 	Messages msgs;
-	int msgMenuStart;
+	int viewEnd; // id of the bottom-most message on screen
+	bool viewFollow; // Keep the newest message at the bottom
+
+	// Search
+	char searchKind; // '/' for substrings, '#' for words
+	char query[MAX_QUERY_LEN + 1];
+	int queryLen;
+	SearchHits hits;
 } State;
 
 static State* statep = NULL; // just a global pointer to the local state
@@ -94,17 +834,27 @@ static void init(State* state);
 static void loop(State* state);
 static void finish(int sig);
 static void resize(int sig);
+static void handleResize(State* state);
 static void printLain(WINDOW* win);
 static void drawUI(State* state);
 static void deleteUi(State* state);
+static char* trimWhitespaces(char *str);
 static char* getFieldText(FIELD* field);
 static void createTextForm(WINDOW *win, State* state);
-static void drawHelp(bool insertMode);
+static void drawHelp(State* state);
 static void drawMessages(State* state);
+static void scrollMessages(State* state, int delta);
+static void runSearch(State* state);
+static void jumpToHit(State* state, int step);
 static bool isValidNumber(const char *str);
 static unsigned short convertPort(const char *port_str);
-static void initConnection(const char* ip, unsigned short port, const char* name, State* state);
+static void drawStatus(State* state);
+static void initConnection(const char* ip, unsigned short port, State* state);
+static void startSession(State* state);
 static bool sendMsg(State* state, const char* format, ...);
+static bool sendDirect(State* state, const char* target, const char* text);
+static bool queueOutbox(State* state, uint8_t type, const char* payload, uint32_t len);
+static void startUpload(State* state, const char* path);
 static void* handleConnection(void* vargp);
 
 static const short lain_art_w = 30;
@@ -142,11 +892,31 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	initSanitizer();
+
 	State state = { 0 };
 	statep = &state;
 	state.name = argv[3];
+	state.viewFollow = true;
+	state.hits.current = -1;
+
+	unsigned short port = convertPort(argv[2]);
+
+	const char* max_download = getenv("WIRED_MAX_DOWNLOAD_MB");
+	state.maxDownload = (max_download && *max_download ? strtoull(max_download, NULL, 10) : DEFAULT_MAX_DOWNLOAD_MB) << 20;
 
-	initConnection(argv[1], convertPort(argv[2]), state.name, &state);
+	if (!initMessages(&state.msgs)) {
+		fprintf(stderr, RED "Error: Couldn't allocate the message history!\n" CRESET);
+		exit(EXIT_FAILURE);
+	}
+
+	// The last screen of the previous session shows up before we even connect
+	openHistoryCache(&state.msgs.cache, argv[1], port);
+	pthread_mutex_lock(&state.msgs.lock);
+	loadOlderMessages(&state.msgs, CACHE_PAGE_MESSAGES);
+	pthread_mutex_unlock(&state.msgs.lock);
+
+	initConnection(argv[1], port, &state);
 	if (pthread_create(&state.net_thread, NULL, handleConnection, &state) != 0) {
 		fprintf(stderr, RED "Error: Couldn't handle connection: pthread error\n" CRESET);
 		finish(0);
@@ -187,10 +957,6 @@ static void init(State* state)
 		init_pair(7, COLOR_WHITE,   COLOR_BLACK);
 	}
 
-	if (!initMessages(&state->msgs)) {
-		finish(0);
-	}
-
 	drawUI(state);
 }
 
@@ -198,13 +964,54 @@ static void loop(State* state)
 {
 	while (1) {
 		int ch = getch();
-		if (state->insertMode) {
+
+		if (state->resized)
+			handleResize(state);
+
+		pthread_mutex_lock(&state->msgs.lock);
+		bool dirty = state->msgs.dirty;
+		pthread_mutex_unlock(&state->msgs.lock);
+		if (dirty)
+			drawMessages(state);
+
+		pthread_mutex_lock(&state->outLock);
+		bool status_dirty = state->statusDirty;
+		pthread_mutex_unlock(&state->outLock);
+		if (status_dirty)
+			drawStatus(state);
+
+		if (ch == ERR)
+			continue;
+
+		if (state->searchMode) {
+			if (ch == 27) { // ESC
+				state->searchMode = false;
+				drawHelp(state);
+			}
+			else if (ch == 13 || ch == KEY_ENTER) {
+				state->searchMode = false;
+				runSearch(state);
+				jumpToHit(state, 0);
+				drawHelp(state);
+			}
+			else if (ch == 127 || ch == KEY_BACKSPACE) {
+				if (state->queryLen > 0)
+					state->query[--state->queryLen] = '\0';
+				drawHelp(state);
+			}
+			else if (ch >= 0x20 && ch <= 0xff && ch != 127 && state->queryLen < MAX_QUERY_LEN) {
+				state->query[state->queryLen++] = ch;
+				state->query[state->queryLen] = '\0';
+				drawHelp(state);
+			}
+		}
+		else if (state->insertMode) {
 			if (ch == 127 || ch == KEY_BACKSPACE) {
 				form_driver(state->textForm, REQ_DEL_PREV);
 			}
 			else if (ch == 27) { // ESC
 				state->insertMode = false;
-				drawHelp(state->insertMode);
+				drawHelp(state);
 				curs_set(FALSE);
 			}
 			else if (ch == KEY_RIGHT) {
@@ -225,9 +1032,27 @@ static void loop(State* state)
 			else if (ch == 13 || ch == KEY_ENTER) {
 				form_driver(state->textForm, REQ_VALIDATION);
 				char* msg = getFieldText(state->textField[0]);
-				if (sendMsg(state, "%s: %s", state->name, msg)) {
+				if (strncmp(msg, "/send ", 6) == 0) {
+					startUpload(state, trimWhitespaces(msg + 6));
+				}
+				else if (strcmp(msg, "/who") == 0) {
+					queueOutbox(state, FRAME_WHO, NULL, 0);
+				}
+				else if (strncmp(msg, "/msg ", 5) == 0) {
+					char* target = trimWhitespaces(msg + 5);
+					char* text = strchr(target, ' ');
+					if (text) {
+						*text++ = '\0';
+						text = trimWhitespaces(text);
+					}
+					if (text && *text && sendDirect(state, target, text)) {
+						char echo[MAX_BUFFER_SIZE];
+						snprintf(echo, sizeof(echo), "[you -> %s] %s", target, text);
+						addMessage(&state->msgs, echo);
+					}
+				}
+				else if (sendMsg(state, "%s: %s", state->name, msg)) {
 					addMessage(&state->msgs, msg);
-					drawMessages(state);
 				}
 			}
 			else {
@@ -236,11 +1061,52 @@ static void loop(State* state)
 		} else {
 			if (ch == 'i' || ch == 'I') {
 				state->insertMode = true;
-				drawHelp(state->insertMode);
+				drawHelp(state);
 				form_driver(state->textForm, REQ_NEXT_CHAR);
 				form_driver(state->textForm, REQ_PREV_CHAR);
 				curs_set(TRUE);
 			}
+			else if (ch == '/' || ch == '#') {
+				state->searchMode = true;
+				state->searchKind = ch;
+				state->queryLen = 0;
+				state->query[0] = '\0';
+				drawHelp(state);
+			}
+			else if (ch == 'n') {
+				jumpToHit(state, -1);
+			}
+			else if (ch == 'N') {
+				jumpToHit(state, 1);
+			}
+			else if (ch == 27) { // ESC clears the search
+				state->hits.count = 0;
+				state->hits.current = -1;
+				drawHelp(state);
+				drawMessages(state);
+			}
+			else if (ch == 'k' || ch == KEY_UP) {
+				scrollMessages(state, -1);
+			}
+			else if (ch == 'j' || ch == KEY_DOWN) {
+				scrollMessages(state, 1);
+			}
+			else if (ch == KEY_PPAGE) {
+				scrollMessages(state, -getmaxy(state->messageWin) / 2);
+			}
+			else if (ch == KEY_NPAGE) {
+				scrollMessages(state, getmaxy(state->messageWin) / 2);
+			}
+			else if (ch == 'G') {
+				state->viewFollow = true;
+				drawMessages(state);
+			}
+			else if (ch == 'd') {
+				pthread_mutex_lock(&state->outLock);
+				state->traceOverlay = !state->traceOverlay;
+				pthread_mutex_unlock(&state->outLock);
+				drawStatus(state);
+			}
 			else if (ch == 'q' || ch == 'Q') {
 				return; // End the program
 			}
@@ -251,9 +1117,16 @@ static void loop(State* state)
 static void finish(int sig)
 {
 	destroyMessages(&statep->msgs);
+	free(statep->hits.ids);
 	if (statep->send_buffer) free(statep->send_buffer);
 	if (statep->recv_buffer) free(statep->recv_buffer);
-	close(statep->socket);
+	if (statep->chunkBuffer) free(statep->chunkBuffer);
+	while (statep->outHead) {
+		OutMsg* msg = statep->outHead;
+		statep->outHead = msg->next;
+		free(msg);
+	}
+	if (statep->socket != -1) close(statep->socket);
 	deleteUi(statep);
 	endwin();
 	exit(EXIT_SUCCESS);
@@ -261,25 +1134,33 @@ static void finish(int sig)
 
 static void resize(int sig)
 {
+	statep->resized = true; // Redrawn by the UI loop, drawing here could deadlock on the message lock
+}
+
+static void handleResize(State* state)
+{
+	state->resized = false;
+
 	curs_set(FALSE);
-	statep->insertMode = false;
+	state->insertMode = false;
+	state->searchMode = false;
 
-	form_driver(statep->textForm, REQ_VALIDATION);
+	form_driver(state->textForm, REQ_VALIDATION);
 
 	endwin();	     // End ncurses mode
 	refresh();	     // Refresh the screen
 	clear();	     // Clear the screen
 
 	char tmp[MAX_BUFFER_SIZE] = { 0 };
-	strncpy(tmp, field_buffer(statep->textField[0], 0), MAX_BUFFER_SIZE);
+	strncpy(tmp, field_buffer(state->textField[0], 0), MAX_BUFFER_SIZE);
 	tmp[MAX_BUFFER_SIZE - 1] = '\0';
-	form_driver(statep->textForm, REQ_CLR_FIELD);
+	form_driver(state->textForm, REQ_CLR_FIELD);
 
-	deleteUi(statep);
-	drawUI(statep);
-	drawMessages(statep);
-	set_field_buffer(statep->textField[0], 0, tmp);
-	form_driver(statep->textForm, REQ_END_FIELD);
+	deleteUi(state);
+	drawUI(state);
+	drawMessages(state);
+	set_field_buffer(state->textField[0], 0, tmp);
+	form_driver(state->textForm, REQ_END_FIELD);
 }
 
 static void printLain(WINDOW* win)
@@ -328,14 +1209,15 @@ static void drawUI(State* state)
 	// MessageWindow
 	scrollok(messageWin, TRUE);
 
-	drawHelp(state->insertMode);
-
 	// Setting states
 	state->lainWin = lainWin;
 	state->sideWin = sideWin;
 	state->mainWin = mainWin;
 	state->textWin = textWin;
 	state->messageWin = messageWin;
+
+	drawHelp(state);
+	drawStatus(state);
 }
 
 static void deleteUi(State* state)
@@ -396,7 +1278,7 @@ static void createTextForm(WINDOW *win, State* state)
 	form_driver(state->textForm, REQ_INS_MODE);
 }
 
-static void drawHelp(bool insertMode)
+static void drawHelp(State* state)
 {
 	int y = getmaxy(stdscr) - 2;
 	for (int x = 1; x < getmaxx(stdscr) - 1; x++) {
@@ -404,29 +1286,179 @@ static void drawHelp(bool insertMode)
 	}
 
 	attron(COLOR_PAIR(4));
-	if (insertMode) {
-		mvprintw(y, 2, "Enter: send message    ESC: leave insert mode	 Ctrl+D: clear entire text field");
+	if (state->searchMode) {
+		mvprintw(y, 2, "%c%s", state->searchKind, state->query);
+	} else if (state->insertMode) {
+		mvprintw(y, 2, "Enter: send message    ESC: leave insert mode	 Ctrl+D: clear entire text field    /send <path>    /msg <name> <text>    /who");
+	} else if (state->hits.current >= 0) {
+		mvprintw(y, 2, "[%d/%d] %c%s    n/N: older/newer hit    ESC: clear search	q: exit",
+			 state->hits.current + 1, state->hits.count, state->searchKind, state->query);
 	} else {
-		mvprintw(y, 2, "i: enter insert mode	q: exit");
+		mvprintw(y, 2, "i: enter insert mode	/: search text	#: search words    j/k: scroll	  G: latest    d: latency    q: exit");
 	}
 	attroff(COLOR_PAIR(4));
 }
 
 static void drawMessages(State* state)
 {
-	wclear(state->messageWin);
+	Messages* msgs = &state->msgs;
+	WINDOW* win = state->messageWin;
+
+	pthread_mutex_lock(&msgs->lock);
+	wclear(win);
+
+	int height, width;
+	getmaxyx(win, height, width);
+
+	// Only the messages that can end up on screen are printed, older ones scroll out
+	int last = msgs->first + msgs->size - 1;
+	int end = state->viewFollow ? last : state->viewEnd;
+	if (end > last) end = last;
+	if (end < msgs->first) end = msgs->first;
+	int start = end - height + 1;
+	if (start < msgs->first) start = msgs->first;
+
+	int hit = state->hits.current >= 0 ? state->hits.ids[state->hits.current] : -1;
+
+	for (int id = start; id <= end && msgs->size > 0; id++) {
+		if (id == hit) wattron(win, A_REVERSE);
+		wprintw(win, "%s\n", msgs->messages[id - msgs->first]);
+		if (id == hit) wattroff(win, A_REVERSE);
+		for (int x = 0; x < width; x++) wprintw(win, "-");
+	}
+
+	msgs->dirty = false;
+	pthread_mutex_unlock(&msgs->lock);
+
+	wrefresh(win);
+}
+
+static void drawStatus(State* state)
+{
+	pthread_mutex_lock(&state->outLock);
+	NetStatus status = state->netStatus;
+	int attempts = state->reconnectAttempts;
+	int pending = state->pending;
+	state->statusDirty = false;
+	pthread_mutex_unlock(&state->outLock);
+
+	int width = getmaxx(state->sideWin) - 4;
+	mvwprintw(state->sideWin, 1, 2, "%-*s", width, "");
+	mvwprintw(state->sideWin, 2, 2, "%-*s", width, "");
+
+	if (status == NET_ONLINE) {
+		wattron(state->sideWin, COLOR_PAIR(2));
+		mvwprintw(state->sideWin, 1, 2, "online");
+		wattroff(state->sideWin, COLOR_PAIR(2));
+	} else {
+		wattron(state->sideWin, COLOR_PAIR(3));
+		mvwprintw(state->sideWin, 1, 2, "reconnecting (%d)", attempts);
+		wattroff(state->sideWin, COLOR_PAIR(3));
+	}
+
+	if (pending > 0)
+		mvwprintw(state->sideWin, 2, 2, "%d unacked", pending);
+
+	// One line per transfer
+	int y = 3;
+	pthread_mutex_lock(&state->outLock);
+	for (int i = 0; i < MAX_TRANSFERS && y < getmaxy(state->sideWin) - 1; i++, y++) {
+		Transfer* t = &state->transfers[i];
+		if (!t->active) {
+			mvwprintw(state->sideWin, y, 2, "%-*s", width, "");
+			continue;
+		}
+
+		int percent = t->size ? (int)(t->done * 100 / t->size) : 100;
+		mvwprintw(state->sideWin, y, 2, "%-*s", width, "");
+		mvwprintw(state->sideWin, y, 2, "%s %.*s %d%%", t->incoming ? "v" : "^", width - 8, t->name, percent);
+	}
+
+	// Latency overlay: summary, then the newest arrivals until we run out of lines
+	int bottom = getmaxy(state->sideWin) - 1;
+	for (int line = y; line < bottom; line++)
+		mvwprintw(state->sideWin, line, 2, "%-*s", width, "");
+
+	if (state->traceOverlay && y + 2 < bottom) {
+		double avg_ms = state->traceSamples ? state->traceSumUs / 1000.0 / state->traceSamples : 0;
+		mvwprintw(state->sideWin, y++, 2, "avg %.2f max %.2f ms", avg_ms, state->traceMaxUs / 1000.0);
+		mvwprintw(state->sideWin, y++, 2, "%llu missed", (unsigned long long)state->traceMissed);
+
+		uint64_t shown = state->traceCount < TRACE_SIZE ? state->traceCount : TRACE_SIZE;
+		for (uint64_t n = 1; n <= shown && y < bottom; n++, y++) {
+			TraceEntry* e = &state->trace[(state->traceCount - n) % TRACE_SIZE];
+			unsigned long long seq = e->seq, missed = e->missed;
+			double ms = e->latencyUs / 1000.0;
+			char line[64];
+			if (e->kind == 'g')
+				snprintf(line, sizeof(line), "gap to #%llu, %llu lost", seq, missed);
+			else if (e->kind == 'a')
+				snprintf(line, sizeof(line), "ack %-6llu rtt %8.2f ms", seq, ms);
+			else if (e->kind == 'd')
+				snprintf(line, sizeof(line), "dm         %8.2f ms", ms);
+			else if (missed > 0)
+				snprintf(line, sizeof(line), "#%-8llu %8.2f ms +%llu", seq, ms, missed);
+			else
+				snprintf(line, sizeof(line), "#%-8llu %8.2f ms", seq, ms);
+			mvwprintw(state->sideWin, y, 2, "%.*s", width, line);
+		}
+	}
+	pthread_mutex_unlock(&state->outLock);
+
+	wrefresh(state->sideWin);
+}
+
+static void scrollMessages(State* state, int delta)
+{
+	Messages* msgs = &state->msgs;
+
+	pthread_mutex_lock(&msgs->lock);
+	int last = msgs->first + msgs->size - 1;
+	int end = (state->viewFollow ? last : state->viewEnd) + delta;
+
+	// Older pages are only read from the cache once the view gets near them
+	if (end - getmaxy(state->messageWin) < msgs->first)
+		loadOlderMessages(msgs, CACHE_PAGE_MESSAGES);
 
-	int index = state->msgs.head;
-	int width = getmaxx(state->messageWin);
+	if (end < msgs->first) end = msgs->first;
+	state->viewFollow = end >= last;
+	state->viewEnd = end;
+	pthread_mutex_unlock(&msgs->lock);
 
-	int i;
-	for (i = 0; i < state->msgs.size; i++, index++) {
-		index %= MAX_MESSAGE_HISTORY;
-		wprintw(state->messageWin, "%s\n", state->msgs.messages[index]);
-		for (int x = 0; x < width; x++) wprintw(state->messageWin, "-");
+	drawMessages(state);
+}
+
+static void runSearch(State* state)
+{
+	state->hits.count = 0;
+	state->hits.current = -1;
+
+	pthread_mutex_lock(&state->msgs.lock);
+	if (state->searchKind == '#')
+		searchWords(&state->msgs, state->query, &state->hits);
+	else
+		searchSubstring(&state->msgs, state->query, &state->hits);
+	pthread_mutex_unlock(&state->msgs.lock);
+}
+
+static void jumpToHit(State* state, int step) // step 0 selects the newest hit
+{
+	SearchHits* hits = &state->hits;
+	if (hits->count == 0) {
+		hits->current = -1;
+		drawHelp(state);
+		return;
 	}
 
-	wrefresh(state->messageWin);
+	if (step == 0 || hits->current < 0)
+		hits->current = hits->count - 1;
+	else
+		hits->current = (hits->current + step + hits->count) % hits->count;
+
+	state->viewFollow = false;
+	state->viewEnd = hits->ids[hits->current];
+	drawHelp(state);
+	drawMessages(state);
 }
 
 // NET
@@ -456,7 +1488,7 @@ static unsigned short convertPort(const char *port_str)
 	return (unsigned short)port;
 }
 
-static void initConnection(const char* ip, unsigned short port, const char* name, State* state)
+static void initConnection(const char* ip, unsigned short port, State* state)
 {
 	state->socket = socket(AF_INET, SOCK_STREAM, 0);
 	if (state->socket == -1) {
@@ -464,82 +1496,947 @@ static void initConnection(const char* ip, unsigned short port, const char* name
 		finish(0);
 	}
 
-	struct sockaddr_in serv_addr = {
+	state->addr = (struct sockaddr_in) {
 		.sin_family = AF_INET,
 		.sin_port = htons(port),
 	};
 
-	if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) <= 0) {
+	if (inet_pton(AF_INET, ip, &state->addr.sin_addr) <= 0) {
 		fprintf(stderr, RED "Invalid address\n" CRESET);
 		finish(0);
 	}
 
-	if (connect(state->socket, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1) {
+	// The first connection is made up front so a wrong address fails right away
+	if (connect(state->socket, (struct sockaddr*)&state->addr, sizeof(state->addr)) == -1) {
 		fprintf(stderr, RED "Connection failed! errno: %s\n" CRESET, strerror(errno));
 		finish(0);
 	}
 
 	state->send_buffer = malloc(MAX_BUFFER_SIZE);
-	state->recv_buffer = malloc(MAX_BUFFER_SIZE);
+	state->recv_buffer = malloc(FRAME_HEADER_LEN + MAX_FRAME_PAYLOAD);
+	state->chunkBuffer = malloc(FRAME_HEADER_LEN + FILE_CHUNK_SIZE);
+	state->datagram = malloc(MULTICAST_HEADER_LEN + FRAME_HEADER_LEN + MAX_BUFFER_SIZE);
+	state->mcastSocket = -1;
 
-	if (!state->send_buffer || !state->recv_buffer) {
+	if (!state->send_buffer || !state->recv_buffer || !state->chunkBuffer || !state->datagram) {
 		fprintf(stderr, RED "Couldn't allocate recv or send buffer!\n" CRESET);
 		finish(0);
 	}
 
-	if (!sendMsg(state, name)) {
-		fprintf(stderr, RED "Connection failed! errno: %s\n" CRESET, strerror(errno));
+	if (pipe(state->wakePipe) == -1 || pthread_mutex_init(&state->outLock, NULL) != 0) {
+		fprintf(stderr, RED "Couldn't create the wakeup pipe! errno: %s\n" CRESET, strerror(errno));
 		finish(0);
 	}
+	fcntl(state->wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(state->wakePipe[1], F_SETFL, O_NONBLOCK);
+
+	if (getrandom(&state->session, sizeof(state->session), 0) != sizeof(state->session))
+		state->session = ((uint64_t)time(NULL) << 32) ^ getpid();
+
+	state->nextSeq = 1;
+	startSession(state);
+}
+
+static void startSession(State* state) // Runs once the socket is connected
+{
+	fcntl(state->socket, F_SETFL, fcntl(state->socket, F_GETFL, 0) | O_NONBLOCK);
+
+	uint32_t len = strlen(state->name);
+	FrameHeader header = {
+		.type = FRAME_HELLO,
+		.flags = PROTOCOL_VERSION | (state->everWelcomed ? HELLO_RESUME : 0),
+		.len = len,
+		.seq = state->lastSeq,
+		.aux = state->session,
+	};
+	packHeader(state->hello, &header);
+	memcpy(state->hello + FRAME_HEADER_LEN, state->name, len);
+	state->helloLen = FRAME_HEADER_LEN + len;
+	state->helloOffset = 0;
+	state->recvLen = 0;
+	state->welcomed = false;
+}
+
+static void setNetStatus(State* state, NetStatus status)
+{
+	pthread_mutex_lock(&state->outLock);
+	state->netStatus = status;
+	state->statusDirty = true;
+	pthread_mutex_unlock(&state->outLock);
+}
+
+static void endTransfer(State* state, Transfer* t, const char* outcome) // Caller holds outLock
+{
+	char text[MAX_BUFFER_SIZE];
+	snprintf(text, sizeof(text), "-- %s %s %s --", t->incoming ? "Download of" : "Upload of", t->name, outcome);
+
+	close(t->fd);
+	t->active = false;
+	state->statusDirty = true;
+
+	pthread_mutex_unlock(&state->outLock); // addMessage takes the message lock
+	addMessage(&state->msgs, text);
+	pthread_mutex_lock(&state->outLock);
+}
+
+static void dropConnection(State* state)
+{
+	close(state->socket);
+	state->socket = -1;
+	state->welcomed = false;
+	state->joining = state->multicast = false; // Until the next server offers a group again
+	state->controlLen = state->controlOffset = 0;
+
+	// Transfers don't survive a reconnect
+	pthread_mutex_lock(&state->outLock);
+	for (int i = 0; i < MAX_TRANSFERS; i++) {
+		if (state->transfers[i].active)
+			endTransfer(state, &state->transfers[i], "was interrupted");
+	}
+	state->chunkLen = state->chunkOffset = 0;
+	pthread_mutex_unlock(&state->outLock);
+
+	setNetStatus(state, NET_RECONNECTING);
 }
 
-static bool sendMsg(State* state, const char* format, ...)
+static bool reconnect(State* state) // Nonblocking connect with a timeout so a dead server can't hang us
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1)
+		return false;
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+	if (connect(sock, (struct sockaddr*)&state->addr, sizeof(state->addr)) == -1) {
+		if (errno != EINPROGRESS) {
+			close(sock);
+			return false;
+		}
+
+		struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) != 1 ||
+		    getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0) {
+			close(sock);
+			return false;
+		}
+	}
+
+	state->socket = sock;
+	startSession(state);
+	return true;
+}
+
+static int backoffDelay(int attempts) // Exponential with +-25% jitter so clients don't come back in lockstep
+{
+	int delay = RECONNECT_MIN_MS;
+	for (int i = 0; i < attempts && delay < RECONNECT_MAX_MS; i++)
+		delay *= 2;
+	if (delay > RECONNECT_MAX_MS)
+		delay = RECONNECT_MAX_MS;
+
+	return delay - delay / 4 + rand() % (delay / 2 + 1);
+}
+
+static bool sendMsg(State* state, const char* format, ...) // Queues the message, the net thread sends it
 {
 	va_list args;
 	va_start(args, format);
 	vsnprintf(state->send_buffer, MAX_BUFFER_SIZE, format, args);
 	va_end(args);
 
-	int snd = send(state->socket, state->send_buffer, strlen(state->send_buffer), 0);
-	if (snd == -1) {
-		fprintf(stderr, RED "send error: %s\n" CRESET, strerror(errno));
+	return queueOutbox(state, FRAME_MSG, state->send_buffer, strlen(state->send_buffer));
+}
+
+static bool sendDirect(State* state, const char* target, const char* text)
+{
+	uint32_t target_len = strlen(target);
+	if (target_len == 0 || target_len > MAX_NAME_LEN)
+		return false;
+
+	// Target name, then the bare text: the server puts our name in front of it
+	memcpy(state->send_buffer, target, target_len + 1);
+	snprintf(state->send_buffer + target_len + 1, MAX_BUFFER_SIZE - target_len - 1, "%s", text);
+	return queueOutbox(state, FRAME_DIRECT, state->send_buffer, target_len + 1 + strlen(state->send_buffer + target_len + 1));
+}
+
+static bool queueOutbox(State* state, uint8_t type, const char* payload, uint32_t len) // Kept until the server acks it
+{
+	OutMsg* msg = malloc(sizeof(OutMsg) + FRAME_HEADER_LEN + len);
+	if (!msg)
+		return false;
+
+	pthread_mutex_lock(&state->outLock);
+	FrameHeader header = { .type = type, .len = len, .seq = state->nextSeq++ };
+	packHeader(msg->frame, &header);
+	if (len > 0)
+		memcpy(msg->frame + FRAME_HEADER_LEN, payload, len);
+	msg->seq = header.seq;
+	msg->len = FRAME_HEADER_LEN + len;
+	msg->next = NULL;
+
+	if (state->outTail)
+		state->outTail->next = msg;
+	else
+		state->outHead = msg;
+	state->outTail = msg;
+	if (!state->sendNext)
+		state->sendNext = msg;
+	state->pending++;
+	state->statusDirty = true;
+	pthread_mutex_unlock(&state->outLock);
+
+	if (write(state->wakePipe[1], "", 1) == -1 && errno != EAGAIN)
 		return false;
+	return true;
+}
+
+static Transfer* freeTransfer(State* state) // Caller holds outLock
+{
+	for (int i = 0; i < MAX_TRANSFERS; i++) {
+		if (!state->transfers[i].active)
+			return &state->transfers[i];
+	}
+	return NULL;
+}
+
+static Transfer* findTransfer(State* state, uint64_t id, bool incoming) // Caller holds outLock
+{
+	for (int i = 0; i < MAX_TRANSFERS; i++) {
+		Transfer* t = &state->transfers[i];
+		if (t->active && t->incoming == incoming && t->id == id)
+			return t;
+	}
+	return NULL;
+}
+
+static void sanitizeFileName(char* out, const char* name, uint32_t len) // Nothing the sender picks escapes DOWNLOAD_DIR
+{
+	const char* slash = memrchr(name, '/', len);
+	if (slash) {
+		len -= slash + 1 - name;
+		name = slash + 1;
+	}
+	if (len > MAX_FILE_NAME_LEN)
+		len = MAX_FILE_NAME_LEN;
+
+	for (uint32_t i = 0; i < len; i++) {
+		unsigned char c = name[i];
+		out[i] = isalnum(c) || c == '.' || c == '-' || c == '_' ? c : '_';
+	}
+	if (len == 0 || out[0] == '.')
+		out[0] = '_';
+	out[len ? len : 1] = '\0';
+}
+
+static void startUpload(State* state, const char* path)
+{
+	char text[MAX_BUFFER_SIZE];
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		snprintf(text, sizeof(text), "-- Can't send %s: %s --", path, fd == -1 ? strerror(errno) : "not a regular file");
+		if (fd != -1) close(fd);
+		addMessage(&state->msgs, text);
+		return;
+	}
+
+	pthread_mutex_lock(&state->outLock);
+	Transfer* t = freeTransfer(state);
+	if (t) {
+		*t = (Transfer) {
+			.active = true,
+			.id = ++state->nextTransfer,
+			.fd = fd,
+			.size = st.st_size,
+		};
+		sanitizeFileName(t->name, path, strlen(path));
+		state->statusDirty = true;
+	}
+	pthread_mutex_unlock(&state->outLock);
+
+	if (!t) {
+		close(fd);
+		addMessage(&state->msgs, "-- Too many transfers, wait for one to finish --");
+		return;
+	}
+
+	if (write(state->wakePipe[1], "", 1) == -1 && errno != EAGAIN)
+		return;
+}
+
+// Puts the next frame of an upload into chunkBuffer, caller holds outLock
+static bool hasChunks(const Transfer* t) // An upload with frames still to pack
+{
+	return t->active && !t->incoming && !(t->begun && t->done == t->size);
+}
+
+static bool nextChunk(State* state)
+{
+	for (int n = 0; n < MAX_TRANSFERS; n++) {
+		state->uploadCursor = (state->uploadCursor + 1) % MAX_TRANSFERS; // Round robin between uploads
+		Transfer* t = &state->transfers[state->uploadCursor];
+		if (!hasChunks(t))
+			continue;
+
+		FrameHeader header = { .aux = t->id };
+		char* payload = state->chunkBuffer + FRAME_HEADER_LEN;
+
+		if (!t->begun) {
+			header.type = FRAME_FILE_BEGIN;
+			header.seq = t->size;
+			header.len = strlen(t->name);
+			memcpy(payload, t->name, header.len);
+			t->begun = true;
+		} else {
+			uint64_t left = t->size - t->done;
+			ssize_t rd = pread(t->fd, payload, left < FILE_CHUNK_SIZE ? left : FILE_CHUNK_SIZE, t->done);
+			if (rd <= 0) { // Shrunk or unreadable, tell the others to give up
+				header.type = FRAME_FILE_ABORT;
+				endTransfer(state, t, "failed");
+			} else {
+				header.type = FRAME_FILE_CHUNK;
+				header.seq = t->done;
+				header.len = rd;
+				t->done += rd;
+				state->statusDirty = true;
+			}
+		}
+
+		packHeader(state->chunkBuffer, &header);
+		state->chunkLen = FRAME_HEADER_LEN + header.len;
+		state->chunkOffset = 0;
+		return true;
+	}
+	return false;
+}
+
+static bool hasUploads(State* state) // Caller holds outLock
+{
+	for (int i = 0; i < MAX_TRANSFERS; i++) {
+		if (hasChunks(&state->transfers[i]))
+			return true;
 	}
+	return false;
+}
+
+static int64_t monotonicMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t wallClockUs(void) // Same clock the server stamps messages with
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void traceArrival(State* state, char kind, uint64_t seq, int64_t latency_us, uint64_t missed)
+{
+	pthread_mutex_lock(&state->outLock);
+	state->trace[state->traceCount++ % TRACE_SIZE] = (TraceEntry){ kind, seq, latency_us, missed };
+	state->traceMissed += missed;
+	if (kind != 'g') {
+		state->traceSumUs += latency_us;
+		state->traceSamples++;
+		if (latency_us > state->traceMaxUs)
+			state->traceMaxUs = latency_us;
+	}
+	if (state->traceOverlay)
+		state->statusDirty = true;
+	pthread_mutex_unlock(&state->outLock);
+}
+
+static int64_t ackMessages(State* state, uint64_t seq) // Everything up to seq reached the server, returns when seq was sent
+{
+	int64_t sent_us = 0;
+	OutMsg* acked = NULL;
+	OutMsg** tail = &acked;
+	pthread_mutex_lock(&state->outLock);
+	while (state->outHead && state->outHead->seq <= seq) {
+		OutMsg* msg = state->outHead;
+		if (msg->seq == seq)
+			sent_us = msg->sentUs;
+		state->outHead = msg->next;
+		if (state->sendNext == msg) {
+			state->sendNext = msg->next;
+			state->sendOffset = 0;
+		}
+		*tail = msg;
+		tail = &msg->next;
+		state->pending--;
+	}
+	*tail = NULL;
+	if (!state->outHead)
+		state->outTail = NULL;
+	state->statusDirty = true;
+	pthread_mutex_unlock(&state->outLock);
+
+	// Ours are in the history now, cached the way everybody else got them
+	while (acked) {
+		OutMsg* msg = acked;
+		acked = msg->next;
+		if (msg->frame[0] == FRAME_MSG)
+			appendToCache(&state->msgs.cache, msg->frame + FRAME_HEADER_LEN, msg->len - FRAME_HEADER_LEN);
+		free(msg);
+	}
+	return sent_us;
+}
+
+static bool queueControl(State* state, uint8_t type, uint8_t flags, uint64_t seq, uint64_t aux) // False while the buffer is full
+{
+	if (state->controlLen + FRAME_HEADER_LEN > CONTROL_BUFFER_SIZE)
+		return false;
+
+	FrameHeader header = { .type = type, .flags = flags, .seq = seq, .aux = aux };
+	packHeader(state->control + state->controlLen, &header);
+	state->controlLen += FRAME_HEADER_LEN;
 	return true;
 }
 
-static void* handleConnection(void* vargp)
+static void requestResend(State* state, uint64_t seq) // Everything up to seq comes over TCP then
 {
-	State* state = (State*) vargp;
+	if (seq > state->resendWant)
+		state->resendWant = seq;
+}
+
+static void queueResend(State* state) // One range for everything asked for since the last flush
+{
+	if (state->resendWant <= state->resendTo)
+		return;
+
+	uint64_t from = (state->resendTo > state->lastSeq ? state->resendTo : state->lastSeq) + 1;
+	if (from > state->resendWant || queueControl(state, FRAME_RESEND, 0, from, state->resendWant))
+		state->resendTo = state->resendWant;
+}
+
+static bool hasOutput(State* state)
+{
+	if (state->helloOffset < state->helloLen)
+		return true;
+	if (state->welcomed && (state->controlOffset < state->controlLen || state->resendWant > state->resendTo))
+		return true;
+
+	pthread_mutex_lock(&state->outLock);
+	bool pending = state->welcomed && (state->sendNext || state->chunkOffset < state->chunkLen || hasUploads(state));
+	pthread_mutex_unlock(&state->outLock);
+	return pending;
+}
+
+static bool flushOutbox(State* state) // Return false if the connection broke
+{
+	while (state->helloOffset < state->helloLen) {
+		int snd = send(state->socket, state->hello + state->helloOffset, state->helloLen - state->helloOffset, MSG_NOSIGNAL);
+		if (snd == -1)
+			return errno == EAGAIN || errno == EINTR;
+		state->helloOffset += snd;
+	}
+
+	if (!state->welcomed)
+		return true;
+
+	queueResend(state);
+	while (state->controlOffset < state->controlLen) {
+		int snd = send(state->socket, state->control + state->controlOffset, state->controlLen - state->controlOffset, MSG_NOSIGNAL);
+		if (snd == -1)
+			return errno == EAGAIN || errno == EINTR;
+		state->controlOffset += snd;
+	}
+	state->controlLen = state->controlOffset = 0;
+
+	// Messages stay in the outbox until acked, so a reconnect can send them again
+	pthread_mutex_lock(&state->outLock);
+	bool ok = true;
+	while (true) {
+		// A chunk that started going out has to finish, then text goes ahead of the next one
+		if (state->chunkOffset < state->chunkLen) {
+			int snd = send(state->socket, state->chunkBuffer + state->chunkOffset,
+				       state->chunkLen - state->chunkOffset, MSG_NOSIGNAL);
+			if (snd == -1) {
+				ok = errno == EAGAIN || errno == EINTR;
+				break;
+			}
+
+			state->chunkOffset += snd;
+			Transfer* t = &state->transfers[state->uploadCursor];
+			if (state->chunkOffset == state->chunkLen && t->active && !t->incoming && t->begun && t->done == t->size)
+				endTransfer(state, t, "done"); // Only now is all of it with the server
+			continue;
+		}
+
+		if (!state->sendNext) {
+			if (nextChunk(state))
+				continue;
+			break;
+		}
+
+		OutMsg* msg = state->sendNext;
+		if (state->sendOffset == 0)
+			msg->sentUs = wallClockUs();
+		int snd = send(state->socket, msg->frame + state->sendOffset, msg->len - state->sendOffset, MSG_NOSIGNAL);
+		if (snd == -1) {
+			ok = errno == EAGAIN || errno == EINTR;
+			break;
+		}
+
+		state->sendOffset += snd;
+		if (state->sendOffset < msg->len)
+			break;
+
+		state->sendNext = msg->next;
+		state->sendOffset = 0;
+	}
+	pthread_mutex_unlock(&state->outLock);
+	return ok;
+}
+
+static bool joinGroup(State* state, const char* group, uint32_t len)
+{
+	char spec[MAX_GROUP_LEN + 1], address[INET_ADDRSTRLEN], text[MAX_BUFFER_SIZE];
+	unsigned short port;
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	if (len > MAX_GROUP_LEN)
+		return false;
+	memcpy(spec, group, len);
+	spec[len] = '\0';
+	if (sscanf(spec, "%15[0-9.]:%hu", address, &port) != 2 || inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+		return false;
+	addr.sin_port = htons(port);
+
+	if (state->mcastSocket != -1 && strcmp(state->mcastGroup, spec) == 0)
+		return true;
+	if (state->mcastSocket != -1)
+		close(state->mcastSocket);
+
+	// Join on the interface the server connection goes through, that's the LAN it's on
+	struct sockaddr_in local;
+	socklen_t local_len = sizeof(local);
+	int on = 1;
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	struct ip_mreq mreq = { .imr_multiaddr = addr.sin_addr };
+	bool ok = sock != -1 && getsockname(state->socket, (struct sockaddr*)&local, &local_len) == 0;
+	if (ok) {
+		mreq.imr_interface = local.sin_addr;
+		ok = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0
+			&& bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0
+			&& setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+	}
+	if (!ok) {
+		snprintf(text, sizeof(text), "-- Couldn't join multicast group %s, messages keep coming over TCP --", spec);
+		addMessage(&state->msgs, text);
+		if (sock != -1)
+			close(sock);
+		state->mcastSocket = -1;
+		return false;
+	}
+
+	snprintf(text, sizeof(text), "-- Messages arrive over multicast group %s --", spec);
+	addMessage(&state->msgs, text);
+	state->mcastSocket = sock;
+	memcpy(state->mcastGroup, spec, len + 1);
+	return true;
+}
 
-	char* buffer = state->recv_buffer;
-	int socket = state->socket;
+static void handleDatagram(State* state, uint64_t origin, const FrameHeader* header, const char* payload);
 
-	int rc;
+static void readDatagrams(State* state)
+{
+	const uint32_t capacity = MULTICAST_HEADER_LEN + FRAME_HEADER_LEN + MAX_BUFFER_SIZE;
 
 	while (true) {
-		rc = recv(socket, buffer, MAX_BUFFER_SIZE, 0);
-		if (rc == 0) {
-			fprintf(stderr, RED "Connection closed!\n" CRESET);
+		struct sockaddr_in from;
+		socklen_t from_len = sizeof(from);
+		ssize_t len = recvfrom(state->mcastSocket, state->datagram, capacity, 0, (struct sockaddr*)&from, &from_len);
+		if (len == -1)
+			return;
+
+		// Anyone on the LAN can send to the group, only the server gets listened to
+		if (from.sin_addr.s_addr != state->addr.sin_addr.s_addr || len < MULTICAST_HEADER_LEN + FRAME_HEADER_LEN)
+			continue;
+
+		uint64_t origin;
+		FrameHeader header;
+		memcpy(&origin, state->datagram, sizeof(origin));
+		unpackHeader(state->datagram + MULTICAST_HEADER_LEN, &header);
+		if (MULTICAST_HEADER_LEN + FRAME_HEADER_LEN + header.len != len)
+			continue;
+		state->heardAt = monotonicMs();
+
+		// The group works, only now can the server stop relaying. TCP still covers this one
+		if (state->joining && queueControl(state, FRAME_MULTICAST, 0, 0, 0)) {
+			state->joining = false;
+			state->multicast = true;
+			continue;
+		}
+		if (!state->multicast) // Whatever came in while we weren't joined, TCP covers it
+			continue;
+
+		handleDatagram(state, be64toh(origin), &header, state->datagram + MULTICAST_HEADER_LEN + FRAME_HEADER_LEN);
+	}
+}
+
+static void leaveGroup(State* state) // The group went quiet, get everything over TCP again
+{
+	char text[MAX_BUFFER_SIZE];
+
+	if (state->multicast && !queueControl(state, FRAME_MULTICAST, MULTICAST_LEAVE, state->lastSeq, 0))
+		return; // Tried again once the control buffer drained
+
+	snprintf(text, sizeof(text), "-- Nothing heard on multicast group %s, messages come over TCP again --", state->mcastGroup);
+	addMessage(&state->msgs, text);
+	close(state->mcastSocket);
+	state->mcastSocket = -1;
+	state->joining = state->multicast = false;
+}
+
+static void declineDownload(State* state, uint64_t id) // Lost with a full control buffer, the chunks get ignored then
+{
+	queueControl(state, FRAME_FILE_ABORT, FILE_ABORT_DECLINE, 0, id);
+}
+
+static bool handleFileBegin(State* state, const FrameHeader* header, const char* payload)
+{
+	char text[MAX_BUFFER_SIZE];
+	char name[MAX_FILE_NAME_LEN + 1];
+	char path[sizeof(DOWNLOAD_DIR) + 32 + MAX_FILE_NAME_LEN];
+
+	const char* sender_end = memchr(payload, '\0', header->len);
+	if (!sender_end)
+		return false;
+
+	sanitizeFileName(name, sender_end + 1, header->len - (sender_end + 1 - payload));
+	snprintf(text, sizeof(text), "-- %s is sending %s (%llu bytes) --", payload, name, (unsigned long long)header->seq);
+	addMessage(&state->msgs, text);
+
+	if (header->seq > state->maxDownload) {
+		snprintf(text, sizeof(text), "-- Turned %s down, it's over the %llu MB download limit --", name,
+			 (unsigned long long)(state->maxDownload >> 20));
+		addMessage(&state->msgs, text);
+		declineDownload(state, header->aux);
+		return true;
+	}
+
+	// Transfer ids start over with every server, so never write over an earlier download
+	mkdir(DOWNLOAD_DIR, 0755);
+	int fd = -1;
+	for (int copy = 1; fd == -1 && copy <= MAX_DOWNLOAD_COPIES; copy++) {
+		if (copy == 1)
+			snprintf(path, sizeof(path), DOWNLOAD_DIR "/%llu-%s", (unsigned long long)header->aux, name);
+		else
+			snprintf(path, sizeof(path), DOWNLOAD_DIR "/%llu.%d-%s", (unsigned long long)header->aux, copy, name);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd == -1 && errno != EEXIST)
+			break;
+	}
+	if (fd == -1) {
+		snprintf(text, sizeof(text), "-- Can't save %s: %s --", path, strerror(errno));
+		addMessage(&state->msgs, text);
+		declineDownload(state, header->aux);
+		return true;
+	}
+
+	pthread_mutex_lock(&state->outLock);
+	Transfer* t = freeTransfer(state);
+	if (t) {
+		*t = (Transfer) {
+			.active = true,
+			.incoming = true,
+			.id = header->aux,
+			.fd = fd,
+			.size = header->seq,
+		};
+		strcpy(t->name, name);
+		state->statusDirty = true;
+		if (t->size == 0)
+			endTransfer(state, t, "saved in " DOWNLOAD_DIR);
+	} else {
+		close(fd);
+		unlink(path);
+		declineDownload(state, header->aux);
+	}
+	pthread_mutex_unlock(&state->outLock);
+	return true;
+}
+
+static bool handleFrame(State* state, const FrameHeader* header, const char* payload)
+{
+	char text[MAX_BUFFER_SIZE + 1];
+
+	switch (header->type) {
+	case FRAME_WELCOME:
+		state->resendTo = state->resendWant = 0; // The server replays what we missed on its own
+		if (state->lastSeq > header->seq)
+			addMessage(&state->msgs, "-- The server restarted, messages may be missing --");
+		if (!state->everWelcomed || state->lastSeq > header->seq)
+			state->lastSeq = header->seq;
+
+		ackMessages(state, header->aux);
+
+		pthread_mutex_lock(&state->outLock);
+		state->sendNext = state->outHead; // Resend everything the server didn't get
+		state->sendOffset = 0;
+		state->welcomed = true;
+		state->everWelcomed = true;
+		state->reconnectAttempts = 0;
+		pthread_mutex_unlock(&state->outLock);
+		setNetStatus(state, NET_ONLINE);
+		return true;
+
+	case FRAME_FULL:
+		if (!state->everWelcomed) {
+			fprintf(stderr, RED "Server is full!\n" CRESET);
 			finish(0);
 		}
+		return false; // Try again later
 
-		if (rc == -1) {
-			fprintf(stderr, RED "Error Reciving message: errno=>%s\n" CRESET, strerror(errno));
+	case FRAME_NAME_TAKEN:
+		if (!state->everWelcomed) {
+			fprintf(stderr, RED "The name %s is taken!\n" CRESET, state->name);
 			finish(0);
 		}
+		addMessage(&state->msgs, "-- Somebody else took our name, retrying --");
+		return false;
 
-		if (rc >= MAX_BUFFER_SIZE) rc = MAX_BUFFER_SIZE - 1;
+	case FRAME_DIRECT: {
+		const char* body = memchr(payload, '\0', header->len);
+		if (!body)
+			return false;
+		body++;
+		snprintf(text, sizeof(text), "[%s -> you] %.*s", payload, (int)(header->len - (body - payload)), body);
+		addMessage(&state->msgs, text);
+		traceArrival(state, 'd', 0, wallClockUs() - (int64_t)header->aux, 0);
+		return true;
+	}
 
-		buffer[rc] = '\0';
+	case FRAME_WHO: {
+		uint64_t listed = header->len > 0;
+		int len = snprintf(text, sizeof(text), "-- Online (%llu): ", (unsigned long long)header->seq);
+		for (uint32_t c = 0; c < header->len && len < (int)sizeof(text) - 1; c++) {
+			if (payload[c] == '\n') {
+				listed++;
+				len += snprintf(text + len, sizeof(text) - len, ", ");
+			} else {
+				text[len++] = payload[c];
+				text[len] = '\0';
+			}
+		}
+		if (header->seq > listed && len < (int)sizeof(text))
+			len += snprintf(text + len, sizeof(text) - len, " and %llu more", (unsigned long long)(header->seq - listed));
+		if (len < (int)sizeof(text))
+			snprintf(text + len, sizeof(text) - len, " --");
+		addMessage(&state->msgs, text);
+		return true;
+	}
 
-		if (strcmp(buffer, SERVER_FULL_STRING) == 0) {
-			fprintf(stderr, RED "Server is full!\n" CRESET);
+	case FRAME_MULTICAST:
+		state->origin = header->seq;
+		if (!state->multicast && !state->joining && joinGroup(state, payload, header->len)) {
+			state->joining = true; // Told the server once the first datagram shows up
+			state->heardAt = monotonicMs();
+		}
+		return true;
+
+	case FRAME_NOTICE:
+		snprintf(text, sizeof(text), "-- %.*s --", (int)header->len, payload);
+		addMessage(&state->msgs, text);
+		return true;
+
+	case FRAME_MSG: {
+		if (header->seq <= state->lastSeq) // Already seen
+			return true;
+
+		int64_t arrived_us = wallClockUs();
+		uint64_t missed = state->everWelcomed ? header->seq - state->lastSeq - 1 : 0;
+		if (missed > 0) {
+			snprintf(text, sizeof(text), "-- Missed %llu messages --", (unsigned long long)missed);
+			addMessage(&state->msgs, text);
+		}
+		state->lastSeq = header->seq;
+
+		memcpy(text, payload, header->len);
+		text[header->len] = '\0';
+		addMessage(&state->msgs, text);
+		appendToCache(&state->msgs.cache, text, strnlen(text, MAX_BUFFER_SIZE - 1));
+		traceArrival(state, 'm', header->seq, arrived_us - (int64_t)header->aux, missed);
+		return true;
+	}
+
+	case FRAME_GAP: {
+		uint64_t from = header->seq > state->lastSeq ? header->seq : state->lastSeq + 1;
+		if (header->aux < from)
+			return true;
+		uint64_t missed = header->aux - from + 1;
+		snprintf(text, sizeof(text), "-- Missed %llu messages, the connection was too slow --", (unsigned long long)missed);
+		addMessage(&state->msgs, text);
+		traceArrival(state, 'g', header->aux, 0, missed);
+		state->lastSeq = header->aux;
+		return true;
+	}
+
+	case FRAME_ACK: {
+		// Our own message took that seq. Only the very next one counts: anything before
+		// it that hasn't shown up was dropped or is still on its way over the group
+		if (header->aux == state->lastSeq + 1)
+			state->lastSeq = header->aux;
+		int64_t sent_us = ackMessages(state, header->seq);
+		if (sent_us)
+			traceArrival(state, 'a', header->seq, wallClockUs() - sent_us, 0);
+		return true;
+	}
+
+	case FRAME_FILE_BEGIN:
+		return handleFileBegin(state, header, payload);
+
+	case FRAME_FILE_CHUNK:
+		pthread_mutex_lock(&state->outLock);
+		Transfer* t = findTransfer(state, header->aux, true);
+		if (t) { // Chunks of transfers that started before we joined are skipped
+			if (header->seq != t->done || pwrite(t->fd, payload, header->len, header->seq) != header->len) {
+				endTransfer(state, t, "failed");
+			} else {
+				t->done += header->len;
+				state->statusDirty = true;
+				if (t->done == t->size)
+					endTransfer(state, t, "saved in " DOWNLOAD_DIR);
+			}
+		}
+		pthread_mutex_unlock(&state->outLock);
+		return true;
+
+	case FRAME_FILE_ABORT:
+		pthread_mutex_lock(&state->outLock);
+		t = findTransfer(state, header->aux, !(header->flags & FILE_ABORT_OWN));
+		if (t && (header->flags & FILE_ABORT_BEHIND))
+			endTransfer(state, t, "was dropped, it fell too far behind the sender");
+		else if (t)
+			endTransfer(state, t, t->incoming ? "was cancelled by the sender" : "was turned down");
+		pthread_mutex_unlock(&state->outLock);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static void handleDatagram(State* state, uint64_t origin, const FrameHeader* header, const char* payload)
+{
+	if (header->type == FRAME_MULTICAST) { // Heartbeat, the last datagrams may have been lost
+		if (header->seq > state->lastSeq)
+			requestResend(state, header->seq);
+		return;
+	}
+
+	if (header->type != FRAME_MSG || header->seq <= state->lastSeq)
+		return;
+
+	if (header->seq > state->lastSeq + 1) { // Something before it got lost, TCP brings it all in order
+		requestResend(state, header->seq);
+		return;
+	}
+
+	if (origin == state->origin) { // Ours, already on screen
+		state->lastSeq = header->seq;
+		return;
+	}
+
+	// The server sanitized the text, but nothing proves a datagram went through it
+	char clean[MAX_BUFFER_SIZE];
+	FrameHeader msg = *header;
+	msg.len = sanitizeText(clean, sizeof(clean), payload, header->len, true);
+	handleFrame(state, &msg, clean);
+}
+
+static bool readFrames(State* state) // Return false if the connection broke
+{
+	const uint32_t capacity = FRAME_HEADER_LEN + MAX_FRAME_PAYLOAD;
+
+	while (true) {
+		int rc = recv(state->socket, state->recv_buffer + state->recvLen, capacity - state->recvLen, 0);
+		if (rc == 0)
+			return false;
+
+		if (rc == -1)
+			return errno == EAGAIN || errno == EINTR;
+
+		state->recvLen += rc;
+
+		uint32_t offset = 0;
+		while (state->recvLen - offset >= FRAME_HEADER_LEN) {
+			FrameHeader header;
+			unpackHeader(state->recv_buffer + offset, &header);
+			if (!checkFrameLength(&header))
+				return false;
+
+			if (state->recvLen - offset < FRAME_HEADER_LEN + header.len)
+				break;
+
+			if (!handleFrame(state, &header, state->recv_buffer + offset + FRAME_HEADER_LEN))
+				return false;
+			offset += FRAME_HEADER_LEN + header.len;
+		}
+
+		memmove(state->recv_buffer, state->recv_buffer + offset, state->recvLen - offset);
+		state->recvLen -= offset;
+	}
+}
+
+static void* handleConnection(void* vargp)
+{
+	State* state = (State*) vargp;
+	char drain[64];
+
+	while (true) {
+		if (state->socket == -1) {
+			// Wait out the backoff, the UI keeps queueing in the meantime
+			poll(NULL, 0, backoffDelay(state->reconnectAttempts));
+			if (!reconnect(state)) {
+				pthread_mutex_lock(&state->outLock);
+				state->reconnectAttempts++;
+				state->statusDirty = true;
+				pthread_mutex_unlock(&state->outLock);
+				continue;
+			}
+		}
+
+		struct pollfd pfds[3] = {
+			{ .fd = state->socket, .events = POLLIN | (hasOutput(state) ? POLLOUT : 0) },
+			{ .fd = state->wakePipe[0], .events = POLLIN },
+			{ .fd = state->mcastSocket, .events = POLLIN }, // Ignored while it's -1
+		};
+
+		// A joined group has to keep talking, the server heartbeats it when nothing gets published
+		int timeout = -1;
+		if (state->joining || state->multicast) {
+			int64_t left = state->heardAt + MULTICAST_TIMEOUT_MS - monotonicMs();
+			timeout = left > 0 ? left : 0;
+		}
+
+		if (poll(pfds, 3, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, RED "Poll failed! errno: %s\n" CRESET, strerror(errno));
 			finish(0);
 		}
 
-		addMessage(&state->msgs, buffer);
-		drawMessages(state);
+		if (pfds[1].revents & POLLIN)
+			while (read(state->wakePipe[0], drain, sizeof(drain)) > 0);
+
+		bool ok = true;
+		if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))
+			ok = readFrames(state);
+		if (pfds[2].revents & POLLIN)
+			readDatagrams(state);
+		if ((state->joining || state->multicast) && monotonicMs() - state->heardAt >= MULTICAST_TIMEOUT_MS)
+			leaveGroup(state);
+		if (ok)
+			ok = flushOutbox(state);
+		if (!ok)
+			dropConnection(state);
 	}
 
 	return NULL; //	 Avoid warrning